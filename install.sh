@@ -19,6 +19,7 @@ make
 echo "Installing binaries..."
 install -D bin/ssdsplash /usr/bin/ssdsplash
 install -D bin/ssdsplash-send /usr/bin/ssdsplash-send
+install -D bin/ssdsplash-convert /usr/bin/ssdsplash-convert
 
 # Install systemd service
 echo "Installing systemd service..."
@@ -4,7 +4,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <linux/i2c-dev.h>
+#include <linux/i2c.h>
 #include <string.h>
 #include "ssdsplash.h"
 
@@ -58,6 +60,7 @@
 // ILI9341 commands
 #define ILI9341_SWRESET         0x01
 #define ILI9341_SLPOUT          0x11
+#define ILI9341_DISPOFF         0x28
 #define ILI9341_DISPON          0x29
 #define ILI9341_CASET           0x2A
 #define ILI9341_PASET           0x2B
@@ -72,68 +75,286 @@
 #define ILI9341_GMCTRN1         0xE1
 
 const display_config_t display_configs[] = {
-    [DISPLAY_128x64] = {128, 64, 8},
-    [DISPLAY_128x32] = {128, 32, 4},
-    [DISPLAY_ILI9341_240x320] = {240, 320, 40},
-    [DISPLAY_SSH1106_128x64] = {128, 64, 8}
+    [DISPLAY_128x64] = {128, 64, 8, PIXEL_FORMAT_MONO},
+    [DISPLAY_128x32] = {128, 32, 4, PIXEL_FORMAT_MONO},
+    [DISPLAY_ILI9341_240x320] = {240, 320, 40, PIXEL_FORMAT_RGB565},
+    [DISPLAY_SSH1106_128x64] = {128, 64, 8, PIXEL_FORMAT_MONO}
 };
 
 static int device_fd = -1;
 display_config_t current_config;
+// Framebuffer in the panel's native layout. For PIXEL_FORMAT_MONO each page
+// is preceded by one spare byte so a page can be sent with its I2C control
+// byte in place, and fb_stride is the distance between pages. For
+// PIXEL_FORMAT_RGB565 fb_stride is the distance between rows.
+// framebuffer points at pixel (0, 0); shadow has the same layout.
+// framebuffer_mem lives in a memfd when possible so clients can map it.
+static uint8_t *framebuffer_mem = NULL;
+static int framebuffer_fd = -1;
 static uint8_t *framebuffer = NULL;
+static size_t fb_stride = 0;
+static size_t fb_size = 0;
+static uint8_t *shadow_mem = NULL;
+static uint8_t *shadow = NULL;
+static bool shadow_valid = false;
 static uint8_t device_address = SSD1306_I2C_ADDRESS_DEFAULT;
 static display_type_t current_display_type = DISPLAY_128x64;
+static spi_config_t spi_cfg = {
+    SPI_SPEED_DEFAULT, SPI_GPIOCHIP_DEFAULT, SPI_DC_LINE_DEFAULT, SPI_RESET_LINE_DEFAULT
+};
+
+// RGB565 staging buffer for SPI transfers, sized to the spidev limit
+static uint8_t *spi_chunk = NULL;
+static size_t spi_chunk_size = 0;
+
+// Per-page column range written since the last display_update().
+// A page is clean when x0 > x1.
+typedef struct {
+    int16_t x0;
+    int16_t x1;
+} dirty_span_t;
+
+static dirty_span_t *dirty = NULL;
 
-static int ssd1306_command(uint8_t cmd) {
-    uint8_t buf[2] = {0x00, cmd};
-    return write(device_fd, buf, 2) == 2 ? 0 : -1;
+static inline void mark_page_dirty(int page, int x0, int x1) {
+    if (x0 < dirty[page].x0) dirty[page].x0 = x0;
+    if (x1 > dirty[page].x1) dirty[page].x1 = x1;
 }
 
-static int ssh1106_command(uint8_t cmd) {
-    uint8_t buf[2] = {0x00, cmd};
-    return write(device_fd, buf, 2) == 2 ? 0 : -1;
+static void reset_dirty_spans(void) {
+    for (int page = 0; page < current_config.pages; page++) {
+        dirty[page].x0 = current_config.width;
+        dirty[page].x1 = -1;
+    }
 }
 
-static int ili9341_command(uint8_t cmd) {
-    // For SPI, different implementation would be needed
-    // This is a placeholder for I2C-based ILI9341
-    uint8_t buf[2] = {0x00, cmd};
-    return write(device_fd, buf, 2) == 2 ? 0 : -1;
+static int band_rows(int page) {
+    int rows = current_config.height - page * 8;
+    return rows < 8 ? rows : 8;
 }
 
-static int ssd1306_data(uint8_t *data, size_t len) {
-    uint8_t *buf = malloc(len + 1);
-    if (!buf) return -1;
+static bool column_changed(int page, int x) {
+    if (current_config.format == PIXEL_FORMAT_MONO) {
+        size_t offset = page * fb_stride + x;
+        return framebuffer[offset] != shadow[offset];
+    }
     
-    buf[0] = 0x40;
-    memcpy(buf + 1, data, len);
-    int ret = write(device_fd, buf, len + 1) == (ssize_t)(len + 1) ? 0 : -1;
-    free(buf);
-    return ret;
+    for (int row = 0; row < band_rows(page); row++) {
+        size_t offset = (page * 8 + row) * fb_stride + x * 2;
+        if (framebuffer[offset] != shadow[offset] || framebuffer[offset + 1] != shadow[offset + 1]) {
+            return true;
+        }
+    }
+    return false;
 }
 
-static int ssh1106_data(uint8_t *data, size_t len) {
-    uint8_t *buf = malloc(len + 1);
-    if (!buf) return -1;
+// Narrows the dirty span of a page down to the columns that actually differ
+// from what was last sent. Returns false if the page needs no transfer.
+static bool changed_span(int page, int *x0, int *x1) {
+    int lo = dirty[page].x0;
+    int hi = dirty[page].x1;
     
-    buf[0] = 0x40;
-    memcpy(buf + 1, data, len);
-    int ret = write(device_fd, buf, len + 1) == (ssize_t)(len + 1) ? 0 : -1;
-    free(buf);
-    return ret;
+    if (lo > hi) return false;
+    
+    if (shadow_valid) {
+        while (lo <= hi && !column_changed(page, lo)) lo++;
+        while (hi >= lo && !column_changed(page, hi)) hi--;
+        if (lo > hi) return false;
+    }
+    
+    *x0 = lo;
+    *x1 = hi;
+    return true;
 }
 
-static int ili9341_data(uint8_t *data, size_t len) {
-    uint8_t *buf = malloc(len + 1);
-    if (!buf) return -1;
+// Snapshots a span of the framebuffer into the shadow. Transfers are sent
+// from this copy, so a client write landing mid-transfer still differs from
+// the shadow and goes out with the next update.
+static void commit_span(int page, int x0, int x1) {
+    if (current_config.format == PIXEL_FORMAT_MONO) {
+        size_t offset = page * fb_stride + x0;
+        memcpy(shadow + offset, framebuffer + offset, x1 - x0 + 1);
+        return;
+    }
     
-    buf[0] = 0x40;
-    memcpy(buf + 1, data, len);
-    int ret = write(device_fd, buf, len + 1) == (ssize_t)(len + 1) ? 0 : -1;
-    free(buf);
+    for (int row = 0; row < band_rows(page); row++) {
+        size_t offset = (page * 8 + row) * fb_stride + x0 * 2;
+        memcpy(shadow + offset, framebuffer + offset, (x1 - x0 + 1) * 2);
+    }
+}
+
+// I2C transfer batching
+//
+// Commands are queued as segments in a small arena and sent together with
+// data segments by bus_flush(): a single I2C_RDWR ioctl when the adapter
+// supports combined transfers, otherwise one write() per segment.
+// Consecutive commands share one 0x00 control byte, so a whole init sequence
+// or address window is a single segment. Spans are sent from the shadow,
+// never from the framebuffer clients can write to mid-transfer. A span
+// starting at column 0 goes out in place, with the 0x40 control byte in the
+// page's spare byte; any other span is copied into the arena, since the
+// byte in front of it is a pixel.
+#define BUS_MAX_SEGMENTS I2C_RDWR_IOCTL_MAX_MSGS
+#define BUS_ARENA_SIZE 256          // holds a full page of the widest mono panel
+
+static struct i2c_msg bus_segments[BUS_MAX_SEGMENTS];
+static int bus_segment_count = 0;
+static uint8_t bus_arena[BUS_ARENA_SIZE];
+static size_t bus_arena_len = 0;
+static bool bus_command_open = false;
+static bool bus_combined = false;
+static bool bus_error = false;
+
+static int bus_flush(void);
+
+static struct i2c_msg *bus_open_segment(size_t arena_len) {
+    if (bus_segment_count == BUS_MAX_SEGMENTS || bus_arena_len + arena_len > BUS_ARENA_SIZE) {
+        if (bus_flush() < 0) bus_error = true;
+    }
+    
+    struct i2c_msg *seg = &bus_segments[bus_segment_count++];
+    seg->addr = device_address;
+    seg->flags = 0;
+    seg->len = 0;
+    seg->buf = NULL;
+    return seg;
+}
+
+static void bus_command(uint8_t cmd) {
+    if (!bus_command_open || bus_arena_len == BUS_ARENA_SIZE) {
+        struct i2c_msg *seg = bus_open_segment(2);
+        seg->buf = bus_arena + bus_arena_len;
+        seg->buf[seg->len++] = 0x00;
+        bus_arena_len++;
+        bus_command_open = true;
+    }
+    
+    struct i2c_msg *seg = &bus_segments[bus_segment_count - 1];
+    seg->buf[seg->len++] = cmd;
+    bus_arena_len++;
+}
+
+// Queues len column bytes of a page starting at column x. data must stay
+// unchanged until bus_flush() and must not point into the shared
+// framebuffer.
+static void bus_data(uint8_t *data, int x, size_t len) {
+    bus_command_open = false;
+    
+    if (x == 0) {
+        struct i2c_msg *seg = bus_open_segment(0);
+        data[-1] = 0x40;
+        seg->buf = data - 1;
+        seg->len = len + 1;
+        return;
+    }
+    
+    struct i2c_msg *seg = bus_open_segment(len + 1);
+    seg->buf = bus_arena + bus_arena_len;
+    seg->buf[0] = 0x40;
+    memcpy(seg->buf + 1, data, len);
+    seg->len = len + 1;
+    bus_arena_len += len + 1;
+}
+
+// Queues a data segment that already starts with its 0x40 control byte.
+// The bytes are only read, so buf may point into a read-only mapping.
+static void bus_data_segment(const uint8_t *buf, size_t len) {
+    bus_command_open = false;
+    
+    struct i2c_msg *seg = bus_open_segment(0);
+    seg->buf = (uint8_t *)buf;
+    seg->len = len;
+}
+
+static int bus_flush(void) {
+    int ret = bus_error ? -1 : 0;
+    
+    if (bus_segment_count > 1 && bus_combined) {
+        struct i2c_rdwr_ioctl_data xfer = {
+            .msgs = bus_segments,
+            .nmsgs = bus_segment_count
+        };
+        if (ioctl(device_fd, I2C_RDWR, &xfer) < 0) ret = -1;
+    } else {
+        for (int i = 0; i < bus_segment_count; i++) {
+            if (write(device_fd, bus_segments[i].buf, bus_segments[i].len) != bus_segments[i].len) {
+                ret = -1;
+            }
+        }
+    }
+    
+    bus_segment_count = 0;
+    bus_arena_len = 0;
+    bus_command_open = false;
+    bus_error = false;
     return ret;
 }
 
+static void ssd1306_command(uint8_t cmd) {
+    bus_command(cmd);
+}
+
+static void ssh1106_command(uint8_t cmd) {
+    bus_command(cmd);
+}
+
+// Addresses columns x0..x1 of one page on a monochrome panel
+static void set_page_window(int page, int x0, int x1) {
+    if (current_display_type == DISPLAY_SSH1106_128x64) {
+        // SSH1106 RAM is 132 columns wide, visible area starts at column 2
+        int column = x0 + 2;
+        ssh1106_command(SSH1106_SETPAGEADDR + page);
+        ssh1106_command(SSH1106_SETLOWCOLUMN + (column & 0x0F));
+        ssh1106_command(SSH1106_SETHIGHCOLUMN + (column >> 4));
+        return;
+    }
+    
+    ssd1306_command(SSD1306_COLUMNADDR);
+    ssd1306_command(x0);
+    ssd1306_command(x1);
+    ssd1306_command(SSD1306_PAGEADDR);
+    ssd1306_command(page);
+    ssd1306_command(page);
+}
+
+static int ili9341_command(uint8_t cmd, const uint8_t *params, size_t len) {
+    return spi_command(cmd, params, len);
+}
+
+static int ili9341_set_window(int x0, int y0, int x1, int y1) {
+    uint8_t caset[4] = {x0 >> 8, x0 & 0xFF, x1 >> 8, x1 & 0xFF};
+    uint8_t paset[4] = {y0 >> 8, y0 & 0xFF, y1 >> 8, y1 & 0xFF};
+    
+    if (ili9341_command(ILI9341_CASET, caset, 4) < 0 ||
+        ili9341_command(ILI9341_PASET, paset, 4) < 0) {
+        return -1;
+    }
+    return ili9341_command(ILI9341_RAMWR, NULL, 0);
+}
+
+// Streams a window of the shadow to the panel. Full-width windows are
+// contiguous and go out directly; narrower ones are packed into the
+// spidev-sized staging buffer first.
+static int ili9341_data(int x0, int y0, int x1, int y1) {
+    size_t line_bytes = (x1 - x0 + 1) * 2;
+    
+    if (line_bytes == fb_stride) {
+        return spi_data(shadow + y0 * fb_stride, (y1 - y0 + 1) * fb_stride);
+    }
+    
+    size_t fill = 0;
+    for (int y = y0; y <= y1; y++) {
+        if (fill + line_bytes > spi_chunk_size) {
+            if (spi_data(spi_chunk, fill) < 0) return -1;
+            fill = 0;
+        }
+        memcpy(spi_chunk + fill, shadow + y * fb_stride + x0 * 2, line_bytes);
+        fill += line_bytes;
+    }
+    
+    return fill > 0 ? spi_data(spi_chunk, fill) : 0;
+}
+
 static int ssd1306_init_display(void) {
     ssd1306_command(SSD1306_DISPLAYOFF);
     ssd1306_command(SSD1306_SETDISPLAYCLOCKDIV);
@@ -160,7 +381,7 @@ static int ssd1306_init_display(void) {
     ssd1306_command(SSD1306_DISPLAYALLON_RESUME);
     ssd1306_command(SSD1306_NORMALDISPLAY);
     ssd1306_command(SSD1306_DISPLAYON);
-    return 0;
+    return bus_flush();
 }
 
 static int ssh1106_init_display(void) {
@@ -187,28 +408,116 @@ static int ssh1106_init_display(void) {
     ssh1106_command(SSD1306_DISPLAYALLON_RESUME);
     ssh1106_command(SSH1106_NORMALDISPLAY);
     ssh1106_command(SSH1106_DISPLAYON);
-    return 0;
+    return bus_flush();
 }
 
 static int ili9341_init_display(void) {
-    ili9341_command(ILI9341_SWRESET);
+    spi_reset();
+    
+    if (ili9341_command(ILI9341_SWRESET, NULL, 0) < 0) return -1;
     usleep(150000);
-    ili9341_command(ILI9341_SLPOUT);
+    ili9341_command(ILI9341_SLPOUT, NULL, 0);
     usleep(500000);
-    ili9341_command(ILI9341_PWCTR1);
-    ili9341_command(0x23);
-    ili9341_command(ILI9341_PWCTR2);
-    ili9341_command(0x10);
-    ili9341_command(ILI9341_VMCTR1);
-    ili9341_command(0x3E);
-    ili9341_command(0x28);
-    ili9341_command(ILI9341_VMCTR2);
-    ili9341_command(0x86);
-    ili9341_command(ILI9341_MADCTL);
-    ili9341_command(0x48);
-    ili9341_command(ILI9341_COLMOD);
-    ili9341_command(0x55);
-    ili9341_command(ILI9341_DISPON);
+    ili9341_command(ILI9341_PWCTR1, (const uint8_t[]){0x23}, 1);
+    ili9341_command(ILI9341_PWCTR2, (const uint8_t[]){0x10}, 1);
+    ili9341_command(ILI9341_VMCTR1, (const uint8_t[]){0x3E, 0x28}, 2);
+    ili9341_command(ILI9341_VMCTR2, (const uint8_t[]){0x86}, 1);
+    ili9341_command(ILI9341_MADCTL, (const uint8_t[]){0x48}, 1);
+    ili9341_command(ILI9341_COLMOD, (const uint8_t[]){0x55}, 1);
+    return ili9341_command(ILI9341_DISPON, NULL, 0);
+}
+
+// Allocates the framebuffer in a sealed memfd so clients can render into it
+// directly. The seals stop a client from resizing it under our mapping.
+// Falls back to plain memory, without sharing, if memfd is unavailable.
+static uint8_t *alloc_framebuffer(size_t size) {
+    framebuffer_fd = memfd_create("ssdsplash-fb", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (framebuffer_fd >= 0) {
+        if (ftruncate(framebuffer_fd, size) == 0 &&
+            fcntl(framebuffer_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0) {
+            void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, framebuffer_fd, 0);
+            if (mem != MAP_FAILED) {
+                return mem;
+            }
+        }
+        close(framebuffer_fd);
+        framebuffer_fd = -1;
+    }
+    
+    fprintf(stderr, "Shared framebuffer unavailable\n");
+    return calloc(size, 1);
+}
+
+static void free_framebuffer(void) {
+    if (framebuffer_fd >= 0) {
+        munmap(framebuffer_mem, fb_size);
+        close(framebuffer_fd);
+        framebuffer_fd = -1;
+    } else {
+        free(framebuffer_mem);
+    }
+    framebuffer_mem = NULL;
+    framebuffer = NULL;
+}
+
+int display_share_framebuffer(display_shared_fb_t *shared) {
+    if (framebuffer_fd < 0) return -1;
+    
+    shared->fd = framebuffer_fd;
+    shared->size = fb_size;
+    shared->offset = framebuffer - framebuffer_mem;
+    shared->stride = fb_stride;
+    return 0;
+}
+
+void display_set_spi_config(const spi_config_t *cfg) {
+    spi_cfg = *cfg;
+}
+
+static int setup_framebuffer(void) {
+    size_t fb_offset;
+    if (current_config.format == PIXEL_FORMAT_RGB565) {
+        fb_stride = current_config.width * 2;
+        fb_size = fb_stride * current_config.height;
+        fb_offset = 0;
+    } else {
+        fb_stride = current_config.width + 1;
+        fb_size = fb_stride * current_config.pages;
+        fb_offset = 1;
+    }
+    
+    framebuffer_mem = alloc_framebuffer(fb_size);
+    shadow_mem = calloc(fb_size, 1);
+    dirty = calloc(current_config.pages, sizeof(dirty_span_t));
+    if (!framebuffer_mem || !shadow_mem || !dirty) {
+        display_cleanup();
+        return -1;
+    }
+    
+    framebuffer = framebuffer_mem + fb_offset;
+    shadow = shadow_mem + fb_offset;
+    
+    // Controller RAM contents are unknown until the first full transfer
+    shadow_valid = false;
+    reset_dirty_spans();
+    return 0;
+}
+
+// Sets up the framebuffer for type without touching any hardware, for
+// tools that render offline and read the result back with
+// display_save_snapshot(). display_update() must not be called.
+int display_init_offscreen(display_type_t type) {
+    if (type >= sizeof(display_configs) / sizeof(display_configs[0])) {
+        return -1;
+    }
+    
+    current_display_type = type;
+    current_config = display_configs[type];
+    
+    if (setup_framebuffer() < 0) {
+        return -1;
+    }
+    display_clear();
     return 0;
 }
 
@@ -235,25 +544,39 @@ int display_init(display_type_t type, const char *device, uint8_t addr) {
         default_device = "/dev/spidev0.0";
     }
     
-    device_fd = open(device ? device : default_device, O_RDWR);
-    if (device_fd < 0) {
-        perror("Failed to open device");
-        return -1;
-    }
-    
-    if (type != DISPLAY_ILI9341_240x320) {
+    if (type == DISPLAY_ILI9341_240x320) {
+        if (spi_open(device ? device : default_device, &spi_cfg) < 0) {
+            return -1;
+        }
+        
+        spi_chunk_size = spi_max_transfer();
+        if (spi_chunk_size < (size_t)current_config.width * 2) {
+            spi_chunk_size = current_config.width * 2;
+        }
+        spi_chunk = malloc(spi_chunk_size);
+        if (!spi_chunk) {
+            spi_close();
+            return -1;
+        }
+    } else {
+        device_fd = open(device ? device : default_device, O_RDWR);
+        if (device_fd < 0) {
+            perror("Failed to open device");
+            return -1;
+        }
+        
         if (ioctl(device_fd, I2C_SLAVE, device_address) < 0) {
             perror("Failed to set I2C slave address");
             close(device_fd);
             device_fd = -1;
             return -1;
         }
+        
+        unsigned long funcs = 0;
+        bus_combined = ioctl(device_fd, I2C_FUNCS, &funcs) == 0 && (funcs & I2C_FUNC_I2C);
     }
     
-    framebuffer = calloc(current_config.width * current_config.pages, 1);
-    if (!framebuffer) {
-        close(device_fd);
-        device_fd = -1;
+    if (setup_framebuffer() < 0) {
         return -1;
     }
     
@@ -288,11 +611,11 @@ void display_cleanup(void) {
             case DISPLAY_128x64:
             case DISPLAY_128x32:
                 ssd1306_command(SSD1306_DISPLAYOFF);
+                bus_flush();
                 break;
             case DISPLAY_SSH1106_128x64:
                 ssh1106_command(SSH1106_DISPLAYOFF);
-                break;
-            case DISPLAY_ILI9341_240x320:
+                bus_flush();
                 break;
             default:
                 break;
@@ -300,57 +623,235 @@ void display_cleanup(void) {
         close(device_fd);
         device_fd = -1;
     }
-    if (framebuffer) {
-        free(framebuffer);
-        framebuffer = NULL;
+    // spi_chunk is only allocated once the SPI device is open
+    if (current_display_type == DISPLAY_ILI9341_240x320 && spi_chunk) {
+        ili9341_command(ILI9341_DISPOFF, NULL, 0);
+        spi_close();
+    }
+    free(spi_chunk);
+    spi_chunk = NULL;
+    spi_chunk_size = 0;
+    if (framebuffer_mem) {
+        free_framebuffer();
     }
+    free(shadow_mem);
+    shadow_mem = NULL;
+    shadow = NULL;
+    free(dirty);
+    dirty = NULL;
+    shadow_valid = false;
 }
 
 void display_clear(void) {
-    if (framebuffer) {
-        memset(framebuffer, 0, current_config.width * current_config.pages);
+    display_fill_rect(0, 0, current_config.width, current_config.height, false);
+}
+
+void display_mark_dirty(int x, int y, int width, int height) {
+    if (!dirty) return;
+    
+    int x0 = x < 0 ? 0 : x;
+    int y0 = y < 0 ? 0 : y;
+    int x1 = x + width - 1;
+    int y1 = y + height - 1;
+    
+    if (x1 >= current_config.width) x1 = current_config.width - 1;
+    if (y1 >= current_config.height) y1 = current_config.height - 1;
+    if (x0 > x1 || y0 > y1) return;
+    
+    for (int page = y0 / 8; page <= y1 / 8; page++) {
+        mark_page_dirty(page, x0, x1);
     }
 }
 
+// Forgets what the controller holds so the next update resends every page.
+// Used whenever a transfer fails part way and GDDRAM contents are unknown.
+static void display_invalidate(void) {
+    shadow_valid = false;
+    display_mark_dirty(0, 0, current_config.width, current_config.height);
+}
+
+// Framebuffer snapshots hold only pixel bytes: one row of width bytes per
+// page on monochrome panels, the whole row-major image on RGB565.
+size_t display_snapshot_size(void) {
+    if (current_config.format == PIXEL_FORMAT_RGB565) {
+        return (size_t)current_config.height * fb_stride;
+    }
+    return (size_t)current_config.pages * current_config.width;
+}
+
+void display_save_snapshot(uint8_t *buf) {
+    if (!framebuffer) return;
+    
+    if (current_config.format == PIXEL_FORMAT_RGB565) {
+        memcpy(buf, framebuffer, display_snapshot_size());
+        return;
+    }
+    for (int page = 0; page < current_config.pages; page++) {
+        memcpy(buf + page * current_config.width, framebuffer + page * fb_stride, current_config.width);
+    }
+}
+
+// Copies the bytes of one framebuffer line that differ from src and
+// returns the changed byte range in *first and *last, or false if none did
+static bool copy_changed(uint8_t *dst, const uint8_t *src, int len, int *first, int *last) {
+    int i = 0;
+    while (i < len && dst[i] == src[i]) i++;
+    if (i == len) return false;
+    
+    int j = len - 1;
+    while (dst[j] == src[j]) j--;
+    
+    memcpy(dst + i, src + i, j - i + 1);
+    *first = i;
+    *last = j;
+    return true;
+}
+
+// Replaces the whole screen with a snapshot. Only the changed span of each
+// page (or row on RGB565) is copied and marked dirty, so showing a frame
+// close to the current one sends little over the bus.
+void display_restore_snapshot(const uint8_t *buf) {
+    if (!framebuffer) return;
+    
+    int first, last;
+    if (current_config.format == PIXEL_FORMAT_RGB565) {
+        for (int y = 0; y < current_config.height; y++) {
+            if (copy_changed(framebuffer + y * fb_stride, buf + y * fb_stride, fb_stride, &first, &last)) {
+                mark_page_dirty(y / 8, first / 2, last / 2);
+            }
+        }
+        return;
+    }
+    for (int page = 0; page < current_config.pages; page++) {
+        if (copy_changed(framebuffer + page * fb_stride, buf + page * current_config.width,
+                         current_config.width, &first, &last)) {
+            mark_page_dirty(page, first, last);
+        }
+    }
+}
+
+// While offscreen, drawing goes to a scratch buffer with the framebuffer's
+// layout, so an image can be rendered and cached without touching the
+// screen or the framebuffer shared with clients. Dirty spans marked
+// meanwhile are discarded.
+static uint8_t *onscreen_framebuffer = NULL;
+static dirty_span_t *onscreen_dirty = NULL;
+
+int display_begin_offscreen(void) {
+    if (!framebuffer || onscreen_framebuffer) return -1;
+    
+    uint8_t *scratch = calloc(fb_size, 1);
+    dirty_span_t *saved = malloc(current_config.pages * sizeof(*saved));
+    if (!scratch || !saved) {
+        free(scratch);
+        free(saved);
+        return -1;
+    }
+    
+    memcpy(saved, dirty, current_config.pages * sizeof(*saved));
+    onscreen_dirty = saved;
+    onscreen_framebuffer = framebuffer;
+    framebuffer = scratch + (framebuffer - framebuffer_mem);
+    return 0;
+}
+
+void display_end_offscreen(void) {
+    if (!onscreen_framebuffer) return;
+    
+    free(framebuffer - (onscreen_framebuffer - framebuffer_mem));
+    framebuffer = onscreen_framebuffer;
+    memcpy(dirty, onscreen_dirty, current_config.pages * sizeof(*dirty));
+    free(onscreen_dirty);
+    onscreen_framebuffer = NULL;
+    onscreen_dirty = NULL;
+}
+
 void display_update(void) {
-    if (device_fd < 0 || !framebuffer) return;
+    if (!framebuffer) return;
+    
+    int x0[current_config.pages];
+    int x1[current_config.pages];
+    bool ok = true;
     
     switch (current_display_type) {
         case DISPLAY_128x64:
         case DISPLAY_128x32:
-            ssd1306_command(SSD1306_COLUMNADDR);
-            ssd1306_command(0);
-            ssd1306_command(current_config.width - 1);
-            ssd1306_command(SSD1306_PAGEADDR);
-            ssd1306_command(0);
-            ssd1306_command(current_config.pages - 1);
-            ssd1306_data(framebuffer, current_config.width * current_config.pages);
-            break;
         case DISPLAY_SSH1106_128x64:
             for (int page = 0; page < current_config.pages; page++) {
-                ssh1106_command(SSH1106_SETPAGEADDR + page);
-                ssh1106_command(SSH1106_SETLOWCOLUMN + 2);
-                ssh1106_command(SSH1106_SETHIGHCOLUMN + 0);
-                ssh1106_data(framebuffer + page * current_config.width, current_config.width);
+                if (!changed_span(page, &x0[page], &x1[page])) continue;
+                
+                commit_span(page, x0[page], x1[page]);
+                set_page_window(page, x0[page], x1[page]);
+                bus_data(shadow + page * fb_stride + x0[page], x0[page], x1[page] - x0[page] + 1);
             }
             break;
-        case DISPLAY_ILI9341_240x320:
-            ili9341_command(ILI9341_CASET);
-            ili9341_command(0x00);
-            ili9341_command(0x00);
-            ili9341_command(0x00);
-            ili9341_command(current_config.width - 1);
-            ili9341_command(ILI9341_PASET);
-            ili9341_command(0x00);
-            ili9341_command(0x00);
-            ili9341_command(0x01);
-            ili9341_command(current_config.height - 1);
-            ili9341_command(ILI9341_RAMWR);
-            ili9341_data(framebuffer, current_config.width * current_config.pages);
+        case DISPLAY_ILI9341_240x320: {
+            // One window covering every changed span
+            int wx0 = current_config.width, wx1 = -1;
+            int wp0 = -1, wp1 = -1;
+            for (int page = 0; page < current_config.pages; page++) {
+                if (!changed_span(page, &x0[page], &x1[page])) continue;
+                if (x0[page] < wx0) wx0 = x0[page];
+                if (x1[page] > wx1) wx1 = x1[page];
+                if (wp0 < 0) wp0 = page;
+                wp1 = page;
+            }
+            if (wp0 < 0) break;
+            
+            int wy0 = wp0 * 8;
+            int wy1 = wp1 * 8 + 7;
+            if (wy1 >= current_config.height) wy1 = current_config.height - 1;
+            
+            for (int page = wp0; page <= wp1; page++) {
+                commit_span(page, wx0, wx1);
+            }
+            if (ili9341_set_window(wx0, wy0, wx1, wy1) < 0 ||
+                ili9341_data(wx0, wy0, wx1, wy1) < 0) {
+                ok = false;
+            }
             break;
+        }
         default:
             break;
     }
+    
+    if (current_display_type != DISPLAY_ILI9341_240x320 && bus_flush() < 0) {
+        ok = false;
+    }
+    
+    if (ok) {
+        shadow_valid = true;
+        reset_dirty_spans();
+    } else {
+        display_invalidate();
+    }
+}
+
+// Queues a span of column bytes for a monochrome panel straight from the
+// caller's buffer, bypassing dirty tracking. data[-1] must hold the 0x40
+// control byte and data must stay valid until display_flush_spans(). The
+// framebuffer and shadow are updated to match what is sent.
+void display_write_span(int page, int x, const uint8_t *data, int len) {
+    if (!framebuffer || current_config.format != PIXEL_FORMAT_MONO) return;
+    
+    size_t offset = page * fb_stride + x;
+    memcpy(framebuffer + offset, data, len);
+    memcpy(shadow + offset, data, len);
+    
+    if (device_fd >= 0) {
+        set_page_window(page, x, x + len - 1);
+        bus_data_segment(data - 1, len + 1);
+    }
+}
+
+int display_flush_spans(void) {
+    if (device_fd < 0) return 0;
+    if (bus_flush() < 0) {
+        // The shadow was updated ahead of the transfer
+        display_invalidate();
+        return -1;
+    }
+    return 0;
 }
 
 void display_draw_pixel(int x, int y, bool on) {
@@ -359,27 +860,132 @@ void display_draw_pixel(int x, int y, bool on) {
     }
     
     int page = y / 8;
+    
+    if (current_config.format == PIXEL_FORMAT_RGB565) {
+        uint8_t color = on ? 0xFF : 0x00;
+        size_t index = y * fb_stride + x * 2;
+        framebuffer[index] = color;
+        framebuffer[index + 1] = color;
+        mark_page_dirty(page, x, x);
+        return;
+    }
+    
     int bit = y % 8;
-    int index = page * current_config.width + x;
+    int index = page * fb_stride + x;
     
     if (on) {
         framebuffer[index] |= (1 << bit);
     } else {
         framebuffer[index] &= ~(1 << bit);
     }
+    mark_page_dirty(page, x, x);
+}
+
+// Copies count big-endian RGB565 pixels into row y starting at x
+void display_put_row_rgb565(int x, int y, const uint8_t *pixels, int count) {
+    if (!framebuffer || current_config.format != PIXEL_FORMAT_RGB565) return;
+    if (y < 0 || y >= current_config.height) return;
+    
+    int c0 = x < 0 ? -x : 0;
+    int c1 = x + count > current_config.width ? current_config.width - x : count;
+    if (c0 >= c1) return;
+    
+    memcpy(framebuffer + y * fb_stride + (x + c0) * 2, pixels + c0 * 2, (c1 - c0) * 2);
+    mark_page_dirty(y / 8, x + c0, x + c1 - 1);
+}
+
+// ORs a column-packed 1bpp bitmap (bit 0 on top, up to 8 rows) into the
+// framebuffer at (x, y). Clipping is done once; on page-packed panels each
+// column then lands in at most two framebuffer bytes.
+void display_blit_columns(const uint8_t *columns, int count, int x, int y) {
+    if (!framebuffer || y <= -8 || y >= current_config.height) return;
+    
+    int c0 = x < 0 ? -x : 0;
+    int c1 = x + count > current_config.width ? current_config.width - x : count;
+    if (c0 >= c1) return;
+    
+    if (current_config.format != PIXEL_FORMAT_MONO) {
+        for (int c = c0; c < c1; c++) {
+            for (int row = 0; row < 8; row++) {
+                if (columns[c] & (1 << row)) display_draw_pixel(x + c, y + row, true);
+            }
+        }
+        return;
+    }
+    
+    int shift = y & 7;
+    int page = (y - shift) / 8;
+    
+    if (page >= 0) {
+        uint8_t *dst = framebuffer + page * fb_stride + x;
+        for (int c = c0; c < c1; c++) {
+            dst[c] |= columns[c] << shift;
+        }
+        mark_page_dirty(page, x + c0, x + c1 - 1);
+    }
+    if (shift && page + 1 < current_config.pages) {
+        uint8_t *dst = framebuffer + (page + 1) * fb_stride + x;
+        for (int c = c0; c < c1; c++) {
+            dst[c] |= columns[c] >> (8 - shift);
+        }
+        mark_page_dirty(page + 1, x + c0, x + c1 - 1);
+    }
+}
+
+// Sets or clears a rectangle a byte at a time. On page-packed panels only
+// the top and bottom page of the rectangle need masking.
+void display_fill_rect(int x, int y, int width, int height, bool on) {
+    int x0 = x < 0 ? 0 : x;
+    int y0 = y < 0 ? 0 : y;
+    int x1 = x + width > current_config.width ? current_config.width : x + width;
+    int y1 = y + height > current_config.height ? current_config.height : y + height;
+    if (!framebuffer || x0 >= x1 || y0 >= y1) return;
+    
+    if (current_config.format == PIXEL_FORMAT_RGB565) {
+        // White and black are both a repeated byte in RGB565
+        for (int row = y0; row < y1; row++) {
+            memset(framebuffer + row * fb_stride + x0 * 2, on ? 0xFF : 0x00, (x1 - x0) * 2);
+        }
+        display_mark_dirty(x0, y0, x1 - x0, y1 - y0);
+        return;
+    }
+    
+    for (int page = y0 / 8; page <= (y1 - 1) / 8; page++) {
+        int top = y0 > page * 8 ? y0 - page * 8 : 0;
+        int bottom = y1 < page * 8 + 8 ? y1 - page * 8 : 8;
+        uint8_t mask = (0xFF << top) & (0xFF >> (8 - bottom));
+        uint8_t *dst = framebuffer + page * fb_stride;
+        
+        if (mask == 0xFF) {
+            memset(dst + x0, on ? 0xFF : 0x00, x1 - x0);
+        } else if (on) {
+            for (int col = x0; col < x1; col++) dst[col] |= mask;
+        } else {
+            for (int col = x0; col < x1; col++) dst[col] &= ~mask;
+        }
+        mark_page_dirty(page, x0, x1 - 1);
+    }
+}
+
+void display_draw_hline(int x, int y, int width, bool on) {
+    display_fill_rect(x, y, width, 1, on);
+}
+
+void display_draw_vline(int x, int y, int height, bool on) {
+    display_fill_rect(x, y, 1, height, on);
 }
 
 void display_draw_progress_bar(int value, int max_value, int x, int y, int width, int height) {
-    if (max_value <= 0) return;
+    if (max_value <= 0 || width <= 0 || height <= 0) return;
     
     int fill_width = (value * width) / max_value;
     if (fill_width > width) fill_width = width;
+    if (fill_width < 0) fill_width = 0;
     
-    for (int py = y; py < y + height; py++) {
-        for (int px = x; px < x + width; px++) {
-            bool fill = (px < x + fill_width);
-            bool border = (py == y || py == y + height - 1 || px == x || px == x + width - 1);
-            display_draw_pixel(px, py, fill || border);
-        }
-    }
-}
\ No newline at end of file
+    display_fill_rect(x, y, fill_width, height, true);
+    display_fill_rect(x + fill_width, y, width - fill_width, height, false);
+    display_draw_hline(x, y, width, true);
+    display_draw_hline(x, y + height - 1, width, true);
+    display_draw_vline(x, y, height, true);
+    display_draw_vline(x + width - 1, y, height, true);
+}
@@ -1,7 +1,6 @@
 #include "ssdsplash.h"
 #include <string.h>
 
-extern void display_draw_pixel(int x, int y, bool on);
 extern display_config_t current_config;
 
 static const uint8_t font_5x7[][5] = {
@@ -100,16 +99,9 @@ static const uint8_t font_5x7[][5] = {
 
 void display_draw_char(char c, int x, int y) {
     if (c < 32 || c > 122) c = 32;
-    int index = c - 32;
     
-    for (int col = 0; col < 5; col++) {
-        uint8_t line = font_5x7[index][col];
-        for (int row = 0; row < 7; row++) {
-            if (line & (1 << row)) {
-                display_draw_pixel(x + col, y + row, true);
-            }
-        }
-    }
+    // Glyph columns are already in the panel's page layout
+    display_blit_columns(font_5x7[c - 32], 5, x, y);
 }
 
 void display_draw_text(const char *text, int x, int y) {
@@ -1,139 +1,864 @@
+#define _GNU_SOURCE
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include "ssdsplash.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-extern void display_draw_pixel(int x, int y, bool on);
 extern display_config_t current_config;
 
-static uint8_t rgb_to_gray(uint8_t r, uint8_t g, uint8_t b) {
-    return (uint8_t)(0.299f * r + 0.587f * g + 0.114f * b);
+typedef struct {
+    image_key_t key;
+    uint8_t *pixels;            // NULL if the slot is free
+    unsigned long last_used;
+} cached_image_t;
+
+static cached_image_t image_cache[IMAGE_CACHE_ENTRIES];
+static size_t image_cache_bytes = 0;
+static size_t image_cache_budget = IMAGE_CACHE_BUDGET_DEFAULT;
+static unsigned long image_clock = 0;
+
+static const uint8_t bayer_4x4[4][4] = {
+    {  0, 128,  32, 160 },
+    { 192,  64, 224,  96 },
+    {  48, 176,  16, 144 },
+    { 240, 112, 208,  80 }
+};
+
+// Row kernels. Luma uses 8-bit fixed-point BT.601 weights (77, 150, 29
+// sum to 256). Each channel count gets its own branch-free loop so the
+// compiler can vectorize it.
+static void gray_row(const uint8_t *src, int channels, uint8_t *gray, int count) {
+    switch (channels) {
+        case 1:
+            memcpy(gray, src, count);
+            break;
+        case 2:
+            for (int x = 0; x < count; x++) {
+                gray[x] = src[x * 2];
+            }
+            break;
+        case 3:
+            for (int x = 0; x < count; x++) {
+                gray[x] = (77 * src[x * 3] + 150 * src[x * 3 + 1] + 29 * src[x * 3 + 2]) >> 8;
+            }
+            break;
+        case 4:
+            for (int x = 0; x < count; x++) {
+                gray[x] = (77 * src[x * 4] + 150 * src[x * 4 + 1] + 29 * src[x * 4 + 2]) >> 8;
+            }
+            break;
+        default:
+            memset(gray, 128, count);
+            break;
+    }
+}
+
+// Same weights as gray_row, applied to per-channel box totals. The result
+// is left scaled by 256.
+static uint64_t luma_total(const uint64_t *totals, int channels) {
+    if (channels == 2) return totals[0] << 8;
+    return 77 * totals[0] + 150 * totals[1] + 29 * totals[2];
+}
+
+// Converts a row to big-endian RGB565, the ILI9341 framebuffer layout
+static void rgb565_row(const uint8_t *src, int channels, uint8_t *out, int count) {
+    if (channels < 3) {
+        for (int x = 0; x < count; x++) {
+            uint8_t v = src[x * channels];
+            uint16_t color = ((v & 0xF8) << 8) | ((v & 0xFC) << 3) | (v >> 3);
+            out[x * 2] = color >> 8;
+            out[x * 2 + 1] = color & 0xFF;
+        }
+        return;
+    }
+    
+    for (int x = 0; x < count; x++) {
+        const uint8_t *p = src + x * channels;
+        uint16_t color = ((p[0] & 0xF8) << 8) | ((p[1] & 0xFC) << 3) | (p[2] >> 3);
+        out[x * 2] = color >> 8;
+        out[x * 2 + 1] = color & 0xFF;
+    }
+}
+
+// Thresholds one gray row against its Bayer row and sets bit in the
+// column bytes; thresholds are pre-expanded to the row width.
+static void dither_row(const uint8_t *gray, const uint8_t *thresholds, uint8_t *bits, int bit, int count) {
+    for (int x = 0; x < count; x++) {
+        bits[x] |= (uint8_t)((gray[x] > thresholds[x]) << bit);
+    }
+}
+
+// Error diffusion works on int16 error rows padded by ERROR_PAD entries on
+// each side, so the kernels can spill past the edges without bounds checks.
+// cur holds the error already pushed into this row, next and next2 the
+// rows below.
+#define ERROR_PAD 2
+
+static void diffuse_floyd_steinberg(const uint8_t *gray, int16_t *cur, int16_t *next,
+                                    uint8_t *bits, int bit, int count) {
+    for (int x = 0; x < count; x++) {
+        int v = gray[x] + cur[x];
+        int on = v > 127;
+        int err = v - (on ? 255 : 0);
+        
+        bits[x] |= (uint8_t)(on << bit);
+        cur[x + 1] += err * 7 / 16;
+        next[x - 1] += err * 3 / 16;
+        next[x] += err * 5 / 16;
+        next[x + 1] += err / 16;
+    }
+}
+
+static void diffuse_atkinson(const uint8_t *gray, int16_t *cur, int16_t *next, int16_t *next2,
+                             uint8_t *bits, int bit, int count) {
+    for (int x = 0; x < count; x++) {
+        int v = gray[x] + cur[x];
+        int on = v > 127;
+        int err = (v - (on ? 255 : 0)) / 8;
+        
+        bits[x] |= (uint8_t)(on << bit);
+        cur[x + 1] += err;
+        cur[x + 2] += err;
+        next[x - 1] += err;
+        next[x] += err;
+        next[x + 1] += err;
+        next2[x] += err;
+    }
+}
+
+// Destination of a rendered image. Rows arrive top to bottom; on
+// monochrome panels they are dithered and packed into column bytes one
+// panel page at a time, then blitted.
+typedef struct {
+    int x, y;
+    int width, height;
+    dither_mode_t dither;
+    uint8_t *row;               // gray or RGB565 scratch row
+    uint8_t *bits;              // column bytes for the current page
+    uint8_t *thresholds;        // 4 Bayer rows, expanded to width
+    int16_t *errors;            // 3 padded error rows, used as a ring
+} image_writer_t;
+
+static int writer_open(image_writer_t *w, int x, int y, int width, int height, dither_mode_t dither) {
+    memset(w, 0, sizeof(*w));
+    w->x = x;
+    w->y = y;
+    w->width = width;
+    w->height = height;
+    w->dither = dither;
+    
+    if (current_config.format == PIXEL_FORMAT_RGB565) {
+        w->row = malloc(width * 2);
+        return w->row ? 0 : -1;
+    }
+    
+    w->row = malloc(width);
+    w->bits = calloc(width, 1);
+    if (!w->row || !w->bits) return -1;
+    
+    if (dither == DITHER_FLOYD_STEINBERG || dither == DITHER_ATKINSON) {
+        w->errors = calloc(3 * (width + 2 * ERROR_PAD), sizeof(*w->errors));
+        return w->errors ? 0 : -1;
+    }
+    
+    w->dither = DITHER_BAYER;
+    w->thresholds = malloc(width * 4);
+    if (!w->thresholds) return -1;
+    
+    for (int r = 0; r < 4; r++) {
+        for (int i = 0; i < width; i++) {
+            w->thresholds[r * width + i] = bayer_4x4[r][(x + i) & 3];
+        }
+    }
+    return 0;
+}
+
+static void writer_close(image_writer_t *w) {
+    free(w->row);
+    free(w->bits);
+    free(w->thresholds);
+    free(w->errors);
+}
+
+// Returns error row index of the ring, offset past its left padding
+static int16_t *writer_error_row(image_writer_t *w, int index) {
+    return w->errors + (index % 3) * (w->width + 2 * ERROR_PAD) + ERROR_PAD;
 }
 
-static uint8_t dither_threshold(int x, int y, uint8_t gray) {
-    static const uint8_t bayer_4x4[4][4] = {
-        {  0, 128,  32, 160 },
-        { 192,  64, 224,  96 },
-        {  48, 176,  16, 144 },
-        { 240, 112, 208,  80 }
-    };
+// Takes row index (0 = top of the image) in the source's channel layout
+static void writer_put_row(image_writer_t *w, int index, const uint8_t *src, int channels) {
+    int y = w->y + index;
     
-    uint8_t threshold = bayer_4x4[y & 3][x & 3];
-    return gray > threshold ? 255 : 0;
+    if (current_config.format == PIXEL_FORMAT_RGB565) {
+        rgb565_row(src, channels, w->row, w->width);
+        display_put_row_rgb565(w->x, y, w->row, w->width);
+        return;
+    }
+    
+    gray_row(src, channels, w->row, w->width);
+    
+    if (w->dither == DITHER_BAYER) {
+        dither_row(w->row, w->thresholds + (y & 3) * w->width, w->bits, y & 7, w->width);
+    } else {
+        int16_t *cur = writer_error_row(w, index);
+        if (w->dither == DITHER_ATKINSON) {
+            diffuse_atkinson(w->row, cur, writer_error_row(w, index + 1), writer_error_row(w, index + 2),
+                             w->bits, y & 7, w->width);
+        } else {
+            diffuse_floyd_steinberg(w->row, cur, writer_error_row(w, index + 1), w->bits, y & 7, w->width);
+        }
+        // This row becomes the one two below the next
+        memset(cur - ERROR_PAD, 0, (w->width + 2 * ERROR_PAD) * sizeof(*cur));
+    }
+    
+    // Flush at the end of each panel page so every blit is page-aligned
+    if ((y & 7) == 7 || index == w->height - 1) {
+        display_blit_columns(w->bits, w->width, w->x, y & ~7);
+        memset(w->bits, 0, w->width);
+    }
 }
 
-int display_load_and_display_image(const char *filename) {
-    int width, height, channels;
-    unsigned char *img_data = stbi_load(filename, &width, &height, &channels, 0);
+int image_decode(const char *filename, decoded_image_t *img) {
+    img->pixels = stbi_load(filename, &img->width, &img->height, &img->channels, 0);
+    img->frames = 1;
+    img->delays = NULL;
     
-    if (!img_data) {
+    if (!img->pixels) {
         printf("Failed to load image: %s\n", stbi_failure_reason());
         return -1;
     }
     
-    printf("Loaded image: %dx%d, channels: %d\n", width, height, channels);
+    printf("Loaded image: %dx%d, channels: %d\n", img->width, img->height, img->channels);
+    return 0;
+}
+
+// Decodes every frame of an animated GIF. Anything else decodes as a
+// single-frame still.
+int image_decode_animation(const char *filename, decoded_image_t *img) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("Failed to open image: %s\n", filename);
+        return -1;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > INT32_MAX) {
+        printf("Failed to read image: %s\n", filename);
+        close(fd);
+        return -1;
+    }
+    
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    
+    img->pixels = NULL;
+    img->delays = NULL;
+    if (st.st_size >= 6 && memcmp(data, "GIF", 3) == 0) {
+        img->pixels = stbi_load_gif_from_memory(data, st.st_size, &img->delays, &img->width, &img->height,
+                                                &img->frames, &img->channels, 0);
+    }
+    munmap(data, st.st_size);
+    
+    if (!img->pixels) {
+        return image_decode(filename, img);
+    }
     
+    printf("Loaded animation: %dx%d, %d frames\n", img->width, img->height, img->frames);
+    return 0;
+}
+
+void image_release(decoded_image_t *img) {
+    if (img->pixels) {
+        stbi_image_free(img->pixels);
+        img->pixels = NULL;
+    }
+    if (img->delays) {
+        stbi_image_free(img->delays);
+        img->delays = NULL;
+    }
+}
+
+static void render_centered(const decoded_image_t *img, dither_mode_t dither) {
     display_clear();
     
-    int start_x = (current_config.width - width) / 2;
-    int start_y = (current_config.height - height) / 2;
+    int start_x = (current_config.width - img->width) / 2;
+    int start_y = (current_config.height - img->height) / 2;
     
     if (start_x < 0) start_x = 0;
     if (start_y < 0) start_y = 0;
     
-    for (int y = 0; y < height && (start_y + y) < current_config.height; y++) {
-        for (int x = 0; x < width && (start_x + x) < current_config.width; x++) {
-            int pixel_idx = (y * width + x) * channels;
-            uint8_t r, g, b;
-            
-            if (channels == 1) {
-                r = g = b = img_data[pixel_idx];
-            } else if (channels == 3) {
-                r = img_data[pixel_idx];
-                g = img_data[pixel_idx + 1];
-                b = img_data[pixel_idx + 2];
-            } else if (channels == 4) {
-                r = img_data[pixel_idx];
-                g = img_data[pixel_idx + 1];
-                b = img_data[pixel_idx + 2];
-            } else {
-                r = g = b = 128;
+    // Images larger than the screen are cropped on the right and bottom
+    int width = img->width < current_config.width - start_x ? img->width : current_config.width - start_x;
+    int height = img->height < current_config.height - start_y ? img->height : current_config.height - start_y;
+    
+    image_writer_t w;
+    if (writer_open(&w, start_x, start_y, width, height, dither) < 0) {
+        writer_close(&w);
+        return;
+    }
+    
+    size_t stride = (size_t)img->width * img->channels;
+    for (int y = 0; y < height; y++) {
+        writer_put_row(&w, y, img->pixels + y * stride, img->channels);
+    }
+    
+    writer_close(&w);
+}
+
+// Largest size with the image's aspect ratio that fits the panel
+static void fit_size(int width, int height, int *out_width, int *out_height) {
+    if ((int64_t)current_config.width * height <= (int64_t)current_config.height * width) {
+        *out_width = current_config.width;
+        *out_height = (int64_t)height * current_config.width / width;
+    } else {
+        *out_height = current_config.height;
+        *out_width = (int64_t)width * current_config.height / height;
+    }
+    
+    if (*out_width < 1) *out_width = 1;
+    if (*out_height < 1) *out_height = 1;
+}
+
+// Monochrome panels only need luma. Luma is linear, so the scalers can
+// apply it to filtered sums or to whole source rows and carry a single
+// channel from then on.
+static bool scale_to_luma(int channels) {
+    return current_config.format == PIXEL_FORMAT_MONO && channels > 1;
+}
+
+// Area-averaging downscaler. Each destination pixel averages the box of
+// source pixels it covers. Source rows are read once and summed into a
+// column-sum row; at the end of each destination row the sums are reduced
+// horizontally and divided out with per-column reciprocals. Column sums
+// stay 32-bit for the hot vertical loop (255 times stb_image's 2^24 row
+// limit still fits); box totals are 64-bit so any box area is safe.
+static void scale_box(const decoded_image_t *img, image_writer_t *w, uint8_t *row, int dst_width, int dst_height) {
+    int channels = img->channels;
+    bool luma = scale_to_luma(channels);
+    int out_channels = luma ? 1 : channels;
+    // Luma totals carry the 8-bit weights, so they are 256 times larger
+    int shift = luma ? 40 : 32;
+    size_t src_stride = (size_t)img->width * channels;
+    int *col_start = malloc(dst_width * sizeof(*col_start));
+    int *col_count = malloc(dst_width * sizeof(*col_count));
+    uint64_t *inv = malloc(dst_width * sizeof(*inv));
+    uint32_t *sums = malloc(src_stride * sizeof(*sums));
+    
+    if (!col_start || !col_count || !inv || !sums) {
+        free(col_start);
+        free(col_count);
+        free(inv);
+        free(sums);
+        return;
+    }
+    
+    for (int d = 0; d < dst_width; d++) {
+        int x0 = (int64_t)d * img->width / dst_width;
+        int x1 = (int64_t)(d + 1) * img->width / dst_width;
+        if (x0 > img->width - 1) x0 = img->width - 1;
+        col_start[d] = x0 * channels;
+        col_count[d] = x1 > x0 ? x1 - x0 : 1;
+    }
+    
+    for (int dy = 0; dy < dst_height; dy++) {
+        int y0 = (int64_t)dy * img->height / dst_height;
+        int y1 = (int64_t)(dy + 1) * img->height / dst_height;
+        if (y0 > img->height - 1) y0 = img->height - 1;
+        if (y1 <= y0) y1 = y0 + 1;
+        
+        const uint8_t *src = img->pixels + y0 * src_stride;
+        for (size_t i = 0; i < src_stride; i++) {
+            sums[i] = src[i];
+        }
+        for (int sy = y0 + 1; sy < y1; sy++) {
+            src += src_stride;
+            for (size_t i = 0; i < src_stride; i++) {
+                sums[i] += src[i];
             }
+        }
+        
+        // 32.32 reciprocals keep the divide out of the per-pixel loop
+        for (int d = 0; d < dst_width; d++) {
+            inv[d] = (1ull << 32) / ((uint64_t)col_count[d] * (y1 - y0));
+        }
+        for (int d = 0; d < dst_width; d++) {
+            const uint32_t *p = sums + col_start[d];
+            uint64_t totals[4] = { 0 };
+            for (int i = 0; i < col_count[d]; i++) {
+                for (int c = 0; c < channels; c++) {
+                    totals[c] += p[i * channels + c];
+                }
+            }
+            // Luma is linear, so weighting the box totals equals
+            // averaging per-pixel luma
+            if (luma) totals[0] = luma_total(totals, channels);
+            for (int c = 0; c < out_channels; c++) {
+                row[d * out_channels + c] = (totals[c] * inv[d] + (1ull << (shift - 1))) >> shift;
+            }
+        }
+        
+        writer_put_row(w, dy, row, out_channels);
+    }
+    
+    free(col_start);
+    free(col_count);
+    free(inv);
+    free(sums);
+}
+
+// Maps destination pixel d to a source position in fixed point with 8
+// fractional bits, aligning pixel centres and clamping to the outermost
+// source pixels. 64-bit, since (src_size - 1) * 256 overflows an int for
+// sources wider than 2^23 pixels.
+static int64_t source_position(int d, int src_size, int dst_size) {
+    int64_t pos = (2 * (int64_t)d + 1) * src_size * 128 / dst_size - 128;
+    if (pos < 0) pos = 0;
+    if (pos > (int64_t)(src_size - 1) * 256) pos = (int64_t)(src_size - 1) * 256;
+    return pos;
+}
+
+// Interpolates one source row horizontally into 8.8 fixed point
+static void bilinear_row(const uint8_t *src, int channels, const int *col_start, const uint8_t *col_frac,
+                         uint16_t *out, int count) {
+    for (int d = 0; d < count; d++) {
+        const uint8_t *p = src + col_start[d];
+        int next = col_start[d + count];
+        int f = col_frac[d];
+        for (int c = 0; c < channels; c++) {
+            out[d * channels + c] = p[c] * (256 - f) + p[next + c] * f;
+        }
+    }
+}
+
+// Bilinear upscaler. The two source rows around each destination row are
+// interpolated horizontally once and reused while the row pair is unchanged.
+// Upscaled sources are smaller than the output, so on monochrome panels
+// they are converted to gray before interpolating.
+static void scale_bilinear(const decoded_image_t *img, image_writer_t *w, uint8_t *row, int dst_width, int dst_height) {
+    bool luma = scale_to_luma(img->channels);
+    int channels = luma ? 1 : img->channels;
+    size_t row_len = (size_t)dst_width * channels;
+    size_t src_stride = (size_t)img->width * img->channels;
+    // col_start holds offsets of the left pixel, then the distance to the right one
+    int *col_start = malloc(2 * dst_width * sizeof(*col_start));
+    uint8_t *col_frac = malloc(dst_width);
+    uint8_t *gray = luma ? malloc(img->width) : NULL;
+    uint16_t *lines[2] = { malloc(row_len * sizeof(uint16_t)), malloc(row_len * sizeof(uint16_t)) };
+    int line_y[2] = { -1, -1 };
+    
+    if (!col_start || !col_frac || (luma && !gray) || !lines[0] || !lines[1]) {
+        free(col_start);
+        free(col_frac);
+        free(gray);
+        free(lines[0]);
+        free(lines[1]);
+        return;
+    }
+    
+    for (int d = 0; d < dst_width; d++) {
+        int64_t pos = source_position(d, img->width, dst_width);
+        int x0 = pos >> 8;
+        col_start[d] = x0 * channels;
+        col_start[d + dst_width] = x0 < img->width - 1 ? channels : 0;
+        col_frac[d] = pos & 0xFF;
+    }
+    
+    for (int dy = 0; dy < dst_height; dy++) {
+        int64_t pos = source_position(dy, img->height, dst_height);
+        int y[2] = { pos >> 8, (pos >> 8) < img->height - 1 ? (pos >> 8) + 1 : pos >> 8 };
+        int f = pos & 0xFF;
+        
+        if (line_y[0] != y[0] && line_y[1] == y[0]) {
+            uint16_t *tmp = lines[0];
+            lines[0] = lines[1];
+            lines[1] = tmp;
+            line_y[0] = y[0];
+            line_y[1] = -1;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (line_y[i] == y[i]) continue;
             
-            uint8_t gray = rgb_to_gray(r, g, b);
-            uint8_t dithered = dither_threshold(start_x + x, start_y + y, gray);
-            
-            display_draw_pixel(start_x + x, start_y + y, dithered > 127);
+            const uint8_t *src = img->pixels + y[i] * src_stride;
+            if (luma) {
+                gray_row(src, img->channels, gray, img->width);
+                src = gray;
+            }
+            bilinear_row(src, channels, col_start, col_frac, lines[i], dst_width);
+            line_y[i] = y[i];
         }
+        
+        for (size_t i = 0; i < row_len; i++) {
+            row[i] = ((uint32_t)lines[0][i] * (256 - f) + (uint32_t)lines[1][i] * f + (1u << 15)) >> 16;
+        }
+        
+        writer_put_row(w, dy, row, channels);
+    }
+    
+    free(col_start);
+    free(col_frac);
+    free(gray);
+    free(lines[0]);
+    free(lines[1]);
+}
+
+static void render_scaled(const decoded_image_t *img, dither_mode_t dither) {
+    int scaled_width, scaled_height;
+    
+    display_clear();
+    fit_size(img->width, img->height, &scaled_width, &scaled_height);
+    
+    int start_x = (current_config.width - scaled_width) / 2;
+    int start_y = (current_config.height - scaled_height) / 2;
+    
+    image_writer_t w;
+    uint8_t *row = malloc((size_t)scaled_width * img->channels);
+    if (writer_open(&w, start_x, start_y, scaled_width, scaled_height, dither) < 0 || !row) {
+        free(row);
+        writer_close(&w);
+        return;
+    }
+    
+    if (scaled_width > img->width || scaled_height > img->height) {
+        scale_bilinear(img, &w, row, scaled_width, scaled_height);
+    } else {
+        scale_box(img, &w, row, scaled_width, scaled_height);
+    }
+    
+    free(row);
+    writer_close(&w);
+}
+
+void image_render(const decoded_image_t *img, bool scaled, dither_mode_t dither) {
+    if (scaled) {
+        render_scaled(img, dither);
+    } else {
+        render_centered(img, dither);
+    }
+}
+
+// Shows a pre-rendered splash image straight from its mapping. Returns 1 if
+// path is not one, so the caller can decode it as a regular image, 0 once
+// it is in the framebuffer, or -1 if it is unusable on this panel.
+int image_show_native(const char *path) {
+    splash_image_header_t header;
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, SPLASH_IMAGE_MAGIC, sizeof(header.magic)) != 0) {
+        close(fd);
+        return 1;
+    }
+    
+    struct stat st;
+    if (header.version != SPLASH_IMAGE_VERSION || header.format != current_config.format ||
+        header.width != current_config.width || header.height != current_config.height ||
+        header.data_size != display_snapshot_size() || fstat(fd, &st) < 0 ||
+        (uint64_t)header.data_offset + header.data_size > (uint64_t)st.st_size) {
+        printf("Splash image does not match this display: %s\n", path);
+        close(fd);
+        return -1;
     }
     
-    stbi_image_free(img_data);
-    display_update();
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
     
+    display_restore_snapshot((const uint8_t *)data + header.data_offset);
+    munmap(data, st.st_size);
     return 0;
 }
 
-int display_load_and_display_image_scaled(const char *filename) {
-    int width, height, channels;
-    unsigned char *img_data = stbi_load(filename, &width, &height, &channels, 0);
+// Browsers treat GIF delays this short as unset and play them at 10 fps.
+// The same applies to .ssda files, so a zero delay cannot spin the player.
+static int animation_delay(int delay) {
+    return delay < ANIMATION_MIN_DELAY_MS ? ANIMATION_DEFAULT_DELAY_MS : delay;
+}
+
+// Renders every frame of img with image_render() and keeps the results.
+// Frames are drawn into a private framebuffer, so the screen, which
+// clients may be writing to, is left untouched.
+int image_render_animation(const decoded_image_t *img, bool scaled, dither_mode_t dither, image_animation_t *anim) {
+    size_t frame_pixels = (size_t)img->width * img->height * img->channels;
     
-    if (!img_data) {
-        printf("Failed to load image: %s\n", stbi_failure_reason());
+    anim->frame_size = display_snapshot_size();
+    anim->frame_count = img->frames;
+    anim->map = NULL;
+    anim->current = -1;
+    anim->frames = malloc(anim->frame_size * img->frames);
+    anim->delays = malloc(img->frames * sizeof(*anim->delays));
+    if (!anim->frames || !anim->delays || display_begin_offscreen() < 0) {
+        image_animation_release(anim);
         return -1;
     }
     
-    printf("Loaded image: %dx%d, channels: %d\n", width, height, channels);
+    for (int f = 0; f < img->frames; f++) {
+        decoded_image_t frame = *img;
+        frame.pixels = img->pixels + f * frame_pixels;
+        frame.frames = 1;
+        frame.delays = NULL;
+        
+        image_render(&frame, scaled, dither);
+        display_save_snapshot(anim->frames + f * anim->frame_size);
+        
+        anim->delays[f] = animation_delay(img->delays ? img->delays[f] : 0);
+    }
+    display_end_offscreen();
+    return 0;
+}
+
+// Checks that every span of an .ssda frame lies within the entry and the
+// screen, so playing it needs no further checks
+static bool valid_spans(const uint8_t *p, const splash_frame_t *frame) {
+    const uint8_t *end = p + frame->size;
     
-    display_clear();
+    for (int i = 0; i < frame->span_count; i++) {
+        if ((size_t)(end - p) < sizeof(splash_span_t)) return false;
+        
+        const splash_span_t *span = (const splash_span_t *)p;
+        if (span->page >= current_config.pages || span->len == 0 ||
+            span->x + span->len > current_config.width || span->control != SPLASH_SPAN_CONTROL) {
+            return false;
+        }
+        p += sizeof(*span);
+        if (end - p < span->len) return false;
+        p += span->len;
+    }
+    return p == end;
+}
+
+// Maps a delta-encoded .ssda animation for image_animation_show(). Returns
+// 1 if path is not one, 0 once loaded, or -1 if it does not match this
+// display or is damaged.
+int image_load_native_animation(const char *path, image_animation_t *anim) {
+    splash_animation_header_t header;
     
-    float scale_x = (float)current_config.width / width;
-    float scale_y = (float)current_config.height / height;
-    float scale = (scale_x < scale_y) ? scale_x : scale_y;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
     
-    if (scale > 1.0f) scale = 1.0f;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, SPLASH_ANIMATION_MAGIC, sizeof(header.magic)) != 0) {
+        close(fd);
+        return 1;
+    }
     
-    int scaled_width = (int)(width * scale);
-    int scaled_height = (int)(height * scale);
+    struct stat st;
+    size_t index_size = (header.frame_count + 1) * sizeof(splash_frame_t);
+    if (header.version != SPLASH_ANIMATION_VERSION || header.format != current_config.format ||
+        header.width != current_config.width || header.height != current_config.height ||
+        header.frame_count == 0 || header.index_offset % sizeof(uint32_t) != 0 || fstat(fd, &st) < 0 ||
+        (uint64_t)header.index_offset + index_size > (uint64_t)st.st_size) {
+        printf("Splash animation does not match this display: %s\n", path);
+        close(fd);
+        return -1;
+    }
     
-    int start_x = (current_config.width - scaled_width) / 2;
-    int start_y = (current_config.height - scaled_height) / 2;
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
     
-    for (int y = 0; y < scaled_height; y++) {
-        for (int x = 0; x < scaled_width; x++) {
-            int src_x = (int)(x / scale);
-            int src_y = (int)(y / scale);
-            
-            if (src_x >= width) src_x = width - 1;
-            if (src_y >= height) src_y = height - 1;
-            
-            int pixel_idx = (src_y * width + src_x) * channels;
-            uint8_t r, g, b;
-            
-            if (channels == 1) {
-                r = g = b = img_data[pixel_idx];
-            } else if (channels == 3) {
-                r = img_data[pixel_idx];
-                g = img_data[pixel_idx + 1];
-                b = img_data[pixel_idx + 2];
-            } else if (channels == 4) {
-                r = img_data[pixel_idx];
-                g = img_data[pixel_idx + 1];
-                b = img_data[pixel_idx + 2];
-            } else {
-                r = g = b = 128;
-            }
-            
-            uint8_t gray = rgb_to_gray(r, g, b);
-            uint8_t dithered = dither_threshold(start_x + x, start_y + y, gray);
-            
-            display_draw_pixel(start_x + x, start_y + y, dithered > 127);
+    memset(anim, 0, sizeof(*anim));
+    anim->map = data;
+    anim->map_size = st.st_size;
+    anim->frame_count = header.frame_count;
+    anim->current = -1;
+    anim->delays = malloc(header.frame_count * sizeof(*anim->delays));
+    if (!anim->delays) {
+        image_animation_release(anim);
+        return -1;
+    }
+    
+    const splash_frame_t *index = (const splash_frame_t *)(anim->map + header.index_offset);
+    for (int i = 0; i <= header.frame_count; i++) {
+        if ((uint64_t)index[i].offset + index[i].size > (uint64_t)st.st_size ||
+            !valid_spans(anim->map + index[i].offset, &index[i])) {
+            printf("Damaged splash animation: %s\n", path);
+            image_animation_release(anim);
+            return -1;
+        }
+        if (i < header.frame_count) {
+            anim->delays[i] = animation_delay(index[i].delay);
+        }
+    }
+    return 0;
+}
+
+static void send_delta(const image_animation_t *anim, int entry) {
+    const splash_animation_header_t *header = (const splash_animation_header_t *)anim->map;
+    const splash_frame_t *frame = (const splash_frame_t *)(anim->map + header->index_offset) + entry;
+    const uint8_t *p = anim->map + frame->offset;
+    
+    for (int i = 0; i < frame->span_count; i++) {
+        const splash_span_t *span = (const splash_span_t *)p;
+        display_write_span(span->page, span->x, p + sizeof(*span), span->len);
+        p += sizeof(*span) + span->len;
+    }
+}
+
+// Rendered frames are restored into the framebuffer for the next
+// display_update(). Mapped frames go to the panel right away as the spans
+// that differ from the frame on screen.
+void image_animation_show(image_animation_t *anim, int frame) {
+    if (!anim->map) {
+        display_restore_snapshot(anim->frames + frame * anim->frame_size);
+        anim->current = frame;
+        return;
+    }
+    
+    if (frame == 0 && anim->current == anim->frame_count - 1 && anim->frame_count > 1) {
+        send_delta(anim, anim->frame_count);
+    } else if (frame == anim->current + 1 && frame > 0) {
+        send_delta(anim, frame);
+    } else {
+        // Not the next frame: rebuild it from the key frame
+        for (int entry = 0; entry <= frame; entry++) {
+            send_delta(anim, entry);
         }
     }
+    if (display_flush_spans() < 0) {
+        fprintf(stderr, "Failed to send animation frame\n");
+    }
+    anim->current = frame;
+}
+
+void image_animation_release(image_animation_t *anim) {
+    if (anim->map) {
+        munmap((void *)anim->map, anim->map_size);
+    }
+    free(anim->frames);
+    free(anim->delays);
+    memset(anim, 0, sizeof(*anim));
+}
+
+// Fills key for the file at path as it is now. Returns -1 if the file
+// cannot be stat'ed, in which case it cannot be cached either.
+int image_key_init(image_key_t *key, const char *path, bool scaled, dither_mode_t dither) {
+    struct stat st;
     
-    stbi_image_free(img_data);
-    display_update();
+    memset(key, 0, sizeof(*key));
+    if (stat(path, &st) < 0) {
+        return -1;
+    }
     
+    strncpy(key->path, path, sizeof(key->path) - 1);
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    key->scaled = scaled;
+    key->dither = dither;
+    key->width = current_config.width;
+    key->height = current_config.height;
+    key->format = current_config.format;
     return 0;
-}
\ No newline at end of file
+}
+
+bool image_key_equal(const image_key_t *a, const image_key_t *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size && a->mtime_ns == b->mtime_ns &&
+           a->scaled == b->scaled && a->dither == b->dither &&
+           a->width == b->width && a->height == b->height && a->format == b->format &&
+           strcmp(a->path, b->path) == 0;
+}
+
+static cached_image_t *find_cached(const image_key_t *key) {
+    for (int i = 0; i < IMAGE_CACHE_ENTRIES; i++) {
+        if (image_cache[i].pixels && image_key_equal(&image_cache[i].key, key)) {
+            return &image_cache[i];
+        }
+    }
+    return NULL;
+}
+
+bool image_cache_contains(const image_key_t *key) {
+    return find_cached(key) != NULL;
+}
+
+static void drop_cached(cached_image_t *entry) {
+    free(entry->pixels);
+    image_cache_bytes -= display_snapshot_size();
+    memset(entry, 0, sizeof(*entry));
+}
+
+// Draws a cached rendering of key into the framebuffer. Returns false on a
+// miss, leaving the framebuffer untouched.
+bool image_cache_draw(const image_key_t *key) {
+    cached_image_t *entry = find_cached(key);
+    
+    if (!entry) return false;
+    
+    display_restore_snapshot(entry->pixels);
+    entry->last_used = ++image_clock;
+    return true;
+}
+
+// Caches the framebuffer as the rendering of key, evicting least recently
+// used entries to stay within the budget
+// Returns whether the image is cached afterwards
+bool image_cache_store(const image_key_t *key) {
+    size_t size = display_snapshot_size();
+    
+    if (find_cached(key)) return true;
+    if (size == 0 || size > image_cache_budget) return false;
+    
+    for (;;) {
+        cached_image_t *free_slot = NULL;
+        cached_image_t *oldest = NULL;
+        for (int i = 0; i < IMAGE_CACHE_ENTRIES; i++) {
+            if (!image_cache[i].pixels) {
+                if (!free_slot) free_slot = &image_cache[i];
+            } else if (!oldest || image_cache[i].last_used < oldest->last_used) {
+                oldest = &image_cache[i];
+            }
+        }
+        
+        if (free_slot && image_cache_bytes + size <= image_cache_budget) {
+            free_slot->pixels = malloc(size);
+            if (!free_slot->pixels) return false;
+            
+            display_save_snapshot(free_slot->pixels);
+            free_slot->key = *key;
+            free_slot->last_used = ++image_clock;
+            image_cache_bytes += size;
+            return true;
+        }
+        
+        drop_cached(oldest);
+    }
+}
+
+void image_set_cache_budget(size_t bytes) {
+    image_cache_budget = bytes;
+}
+
+size_t image_get_cache_budget(void) {
+    return image_cache_budget;
+}
+
+void image_cache_cleanup(void) {
+    for (int i = 0; i < IMAGE_CACHE_ENTRIES; i++) {
+        if (image_cache[i].pixels) {
+            drop_cached(&image_cache[i]);
+        }
+    }
+}
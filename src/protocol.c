@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include "ssdsplash.h"
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static void put_i32(uint8_t *p, int32_t v) {
+    uint32_t u = (uint32_t)v;
+    p[0] = u & 0xFF;
+    p[1] = (u >> 8) & 0xFF;
+    p[2] = (u >> 16) & 0xFF;
+    p[3] = u >> 24;
+}
+
+static int32_t get_i32(const uint8_t *p) {
+    return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+} writer_t;
+
+static void put_field(writer_t *w, uint8_t tag, const void *value, size_t len) {
+    if (w->overflow || w->len + 3 + len > w->size) {
+        w->overflow = true;
+        return;
+    }
+    w->buf[w->len] = tag;
+    put_u16(w->buf + w->len + 1, len);
+    memcpy(w->buf + w->len + 3, value, len);
+    w->len += 3 + len;
+}
+
+static void put_int_field(writer_t *w, uint8_t tag, int value) {
+    uint8_t v[4];
+    put_i32(v, value);
+    put_field(w, tag, v, sizeof(v));
+}
+
+static void put_string_field(writer_t *w, uint8_t tag, const char *value, size_t max_len) {
+    put_field(w, tag, value, strnlen(value, max_len));
+}
+
+// Encodes msg as a framed message. Returns the frame length, or -1 if it
+// does not fit in size bytes.
+int protocol_encode(const ssdsplash_message_t *msg, uint8_t *buf, size_t size) {
+    if (size < SSDSPLASH_HEADER_LEN) return -1;
+    
+    size_t payload_size = size - SSDSPLASH_HEADER_LEN;
+    if (payload_size > SSDSPLASH_MAX_PAYLOAD) payload_size = SSDSPLASH_MAX_PAYLOAD;
+    writer_t w = { buf + SSDSPLASH_HEADER_LEN, payload_size, 0, false };
+    
+    switch (msg->type) {
+        case MSG_TYPE_TEXT:
+            put_string_field(&w, FIELD_TEXT, msg->data.text_msg.text, SSDSPLASH_MAX_TEXT_LEN);
+            if (msg->data.text_msg.line != 0) {
+                put_int_field(&w, FIELD_LINE, msg->data.text_msg.line);
+            }
+            if (msg->data.text_msg.font_path[0]) {
+                put_string_field(&w, FIELD_FONT_PATH, msg->data.text_msg.font_path, SSDSPLASH_MAX_PATH_LEN);
+                put_int_field(&w, FIELD_FONT_SIZE, msg->data.text_msg.font_size);
+            }
+            break;
+        case MSG_TYPE_PROGRESS:
+            put_int_field(&w, FIELD_VALUE, msg->data.progress_msg.value);
+            put_int_field(&w, FIELD_MAX_VALUE, msg->data.progress_msg.max_value);
+            break;
+        case MSG_TYPE_IMAGE:
+        case MSG_TYPE_ANIMATION:
+        case MSG_TYPE_PRELOAD:
+            put_string_field(&w, FIELD_PATH, msg->data.image_msg.path, SSDSPLASH_MAX_PATH_LEN);
+            if (msg->data.image_msg.scaled) {
+                uint8_t scaled = 1;
+                put_field(&w, FIELD_SCALED, &scaled, 1);
+            }
+            if (msg->data.image_msg.dither != DITHER_BAYER) {
+                put_int_field(&w, FIELD_DITHER, msg->data.image_msg.dither);
+            }
+            if (msg->data.image_msg.loops > 0) {
+                put_int_field(&w, FIELD_LOOPS, msg->data.image_msg.loops);
+            }
+            break;
+        case MSG_TYPE_MAP_FRAMEBUFFER:
+            // Empty as a request; the daemon's reply carries the layout
+            if (msg->data.framebuffer_msg.size > 0) {
+                put_int_field(&w, FIELD_WIDTH, msg->data.framebuffer_msg.width);
+                put_int_field(&w, FIELD_HEIGHT, msg->data.framebuffer_msg.height);
+                put_int_field(&w, FIELD_FORMAT, msg->data.framebuffer_msg.format);
+                put_int_field(&w, FIELD_STRIDE, msg->data.framebuffer_msg.stride);
+                put_int_field(&w, FIELD_OFFSET, msg->data.framebuffer_msg.offset);
+                put_int_field(&w, FIELD_SIZE, msg->data.framebuffer_msg.size);
+            }
+            break;
+        case MSG_TYPE_COMMIT:
+            put_int_field(&w, FIELD_X, msg->data.commit_msg.x);
+            put_int_field(&w, FIELD_Y, msg->data.commit_msg.y);
+            put_int_field(&w, FIELD_WIDTH, msg->data.commit_msg.width);
+            put_int_field(&w, FIELD_HEIGHT, msg->data.commit_msg.height);
+            break;
+        default:
+            break;
+    }
+    
+    if (w.overflow) return -1;
+    
+    buf[0] = SSDSPLASH_PROTO_MAGIC0;
+    buf[1] = SSDSPLASH_PROTO_MAGIC1;
+    buf[2] = SSDSPLASH_PROTO_VERSION;
+    buf[3] = msg->type;
+    put_u16(buf + 4, w.len);
+    return SSDSPLASH_HEADER_LEN + w.len;
+}
+
+static void copy_string(char *dst, size_t dst_size, const uint8_t *src, size_t len) {
+    if (len >= dst_size) len = dst_size - 1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+static void decode_field(ssdsplash_message_t *msg, uint8_t tag, const uint8_t *value, size_t len) {
+    int32_t num = len == 4 ? get_i32(value) : 0;
+    
+    switch (msg->type) {
+        case MSG_TYPE_TEXT:
+            if (tag == FIELD_TEXT) {
+                copy_string(msg->data.text_msg.text, sizeof(msg->data.text_msg.text), value, len);
+            } else if (tag == FIELD_LINE) {
+                msg->data.text_msg.line = num;
+            } else if (tag == FIELD_FONT_PATH) {
+                copy_string(msg->data.text_msg.font_path, sizeof(msg->data.text_msg.font_path), value, len);
+            } else if (tag == FIELD_FONT_SIZE) {
+                msg->data.text_msg.font_size = num;
+            }
+            break;
+        case MSG_TYPE_PROGRESS:
+            if (tag == FIELD_VALUE) {
+                msg->data.progress_msg.value = num;
+            } else if (tag == FIELD_MAX_VALUE) {
+                msg->data.progress_msg.max_value = num;
+            }
+            break;
+        case MSG_TYPE_IMAGE:
+        case MSG_TYPE_ANIMATION:
+        case MSG_TYPE_PRELOAD:
+            if (tag == FIELD_PATH) {
+                copy_string(msg->data.image_msg.path, sizeof(msg->data.image_msg.path), value, len);
+            } else if (tag == FIELD_SCALED) {
+                msg->data.image_msg.scaled = len > 0 && value[0];
+            } else if (tag == FIELD_DITHER) {
+                msg->data.image_msg.dither = num;
+            } else if (tag == FIELD_LOOPS) {
+                msg->data.image_msg.loops = num;
+            }
+            break;
+        case MSG_TYPE_MAP_FRAMEBUFFER:
+            if (tag == FIELD_WIDTH) {
+                msg->data.framebuffer_msg.width = num;
+            } else if (tag == FIELD_HEIGHT) {
+                msg->data.framebuffer_msg.height = num;
+            } else if (tag == FIELD_FORMAT) {
+                msg->data.framebuffer_msg.format = num;
+            } else if (tag == FIELD_STRIDE) {
+                msg->data.framebuffer_msg.stride = num;
+            } else if (tag == FIELD_OFFSET) {
+                msg->data.framebuffer_msg.offset = num;
+            } else if (tag == FIELD_SIZE) {
+                msg->data.framebuffer_msg.size = num;
+            }
+            break;
+        case MSG_TYPE_COMMIT:
+            if (tag == FIELD_X) {
+                msg->data.commit_msg.x = num;
+            } else if (tag == FIELD_Y) {
+                msg->data.commit_msg.y = num;
+            } else if (tag == FIELD_WIDTH) {
+                msg->data.commit_msg.width = num;
+            } else if (tag == FIELD_HEIGHT) {
+                msg->data.commit_msg.height = num;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void set_defaults(ssdsplash_message_t *msg, message_type_t type) {
+    memset(msg, 0, sizeof(*msg));
+    msg->type = type;
+    if (type == MSG_TYPE_TEXT) {
+        msg->data.text_msg.font_size = 12;
+    } else if (type == MSG_TYPE_PROGRESS) {
+        msg->data.progress_msg.max_value = 100;
+    }
+}
+
+void protocol_from_legacy(const ssdsplash_legacy_message_t *legacy, ssdsplash_message_t *msg) {
+    set_defaults(msg, legacy->type);
+    
+    switch (legacy->type) {
+        case MSG_TYPE_TEXT:
+            copy_string(msg->data.text_msg.text, sizeof(msg->data.text_msg.text),
+                        (const uint8_t *)legacy->data.text_msg.text,
+                        strnlen(legacy->data.text_msg.text, sizeof(legacy->data.text_msg.text)));
+            copy_string(msg->data.text_msg.font_path, sizeof(msg->data.text_msg.font_path),
+                        (const uint8_t *)legacy->data.text_msg.font_path,
+                        strnlen(legacy->data.text_msg.font_path, sizeof(legacy->data.text_msg.font_path)));
+            msg->data.text_msg.line = legacy->data.text_msg.line;
+            msg->data.text_msg.font_size = legacy->data.text_msg.font_size;
+            break;
+        case MSG_TYPE_PROGRESS:
+            msg->data.progress_msg.value = legacy->data.progress_msg.value;
+            msg->data.progress_msg.max_value = legacy->data.progress_msg.max_value;
+            break;
+        case MSG_TYPE_IMAGE:
+            copy_string(msg->data.image_msg.path, sizeof(msg->data.image_msg.path),
+                        (const uint8_t *)legacy->data.image_msg.path,
+                        strnlen(legacy->data.image_msg.path, sizeof(legacy->data.image_msg.path)));
+            msg->data.image_msg.scaled = legacy->data.image_msg.scaled;
+            break;
+        default:
+            break;
+    }
+}
+
+// Decodes the first message in buf, framed or legacy. Returns the number
+// of bytes consumed, 0 if more data is needed, or -1 on a malformed frame.
+// Messages of unknown type decode with msg->type left as sent.
+int protocol_decode(const uint8_t *buf, size_t len, ssdsplash_message_t *msg, size_t *consumed) {
+    if (len < 2) return 0;
+    
+    if (buf[0] != SSDSPLASH_PROTO_MAGIC0 || buf[1] != SSDSPLASH_PROTO_MAGIC1) {
+        ssdsplash_legacy_message_t legacy;
+        if (len < sizeof(legacy)) return 0;
+        
+        memcpy(&legacy, buf, sizeof(legacy));
+        protocol_from_legacy(&legacy, msg);
+        *consumed = sizeof(legacy);
+        return *consumed;
+    }
+    
+    if (len < SSDSPLASH_HEADER_LEN) return 0;
+    
+    uint8_t version = buf[2];
+    size_t payload_len = get_u16(buf + 4);
+    if (version == 0 || payload_len > SSDSPLASH_MAX_PAYLOAD) return -1;
+    if (len < SSDSPLASH_HEADER_LEN + payload_len) return 0;
+    
+    set_defaults(msg, buf[3]);
+    
+    const uint8_t *p = buf + SSDSPLASH_HEADER_LEN;
+    const uint8_t *end = p + payload_len;
+    while (p < end) {
+        if (end - p < 3) return -1;
+        
+        uint8_t tag = p[0];
+        size_t field_len = get_u16(p + 1);
+        p += 3;
+        if ((size_t)(end - p) < field_len) return -1;
+        
+        decode_field(msg, tag, p, field_len);
+        p += field_len;
+    }
+    
+    *consumed = SSDSPLASH_HEADER_LEN + payload_len;
+    return *consumed;
+}
@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include <linux/gpio.h>
+#include "ssdsplash.h"
+
+#define SPI_BUFSIZ_PATH "/sys/module/spidev/parameters/bufsiz"
+#define SPI_BUFSIZ_DEFAULT 4096
+
+// Line order inside the GPIO handle request
+#define GPIO_DC 0
+#define GPIO_RESET 1
+
+static int spi_fd = -1;
+static int gpio_fd = -1;
+static uint32_t spi_speed = SPI_SPEED_DEFAULT;
+static size_t spi_bufsiz = SPI_BUFSIZ_DEFAULT;
+static struct gpiohandle_data gpio_values;
+static int gpio_lines = 0;
+
+// spidev rejects any message larger than its bufsiz module parameter,
+// so transfers are chunked to whatever the running kernel allows.
+static size_t read_spidev_bufsiz(void) {
+    FILE *f = fopen(SPI_BUFSIZ_PATH, "r");
+    if (!f) return SPI_BUFSIZ_DEFAULT;
+    
+    unsigned long bufsiz = 0;
+    if (fscanf(f, "%lu", &bufsiz) != 1 || bufsiz == 0) {
+        bufsiz = SPI_BUFSIZ_DEFAULT;
+    }
+    fclose(f);
+    return bufsiz;
+}
+
+static int gpio_set(int line, int value) {
+    if (gpio_fd < 0 || line >= gpio_lines) return 0;
+    if (gpio_values.values[line] == value) return 0;
+    
+    gpio_values.values[line] = value;
+    return ioctl(gpio_fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &gpio_values) < 0 ? -1 : 0;
+}
+
+static int gpio_open(const spi_config_t *cfg) {
+    int chip_fd = open(cfg->gpiochip ? cfg->gpiochip : SPI_GPIOCHIP_DEFAULT, O_RDWR);
+    if (chip_fd < 0) {
+        perror("Failed to open GPIO chip");
+        return -1;
+    }
+    
+    struct gpiohandle_request req;
+    memset(&req, 0, sizeof(req));
+    req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+    req.lineoffsets[GPIO_DC] = cfg->dc_line;
+    req.default_values[GPIO_DC] = 1;
+    req.lines = 1;
+    if (cfg->reset_line >= 0) {
+        req.lineoffsets[GPIO_RESET] = cfg->reset_line;
+        req.default_values[GPIO_RESET] = 1;
+        req.lines = 2;
+    }
+    strncpy(req.consumer_label, "ssdsplash", sizeof(req.consumer_label) - 1);
+    
+    if (ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &req) < 0) {
+        perror("Failed to request DC/RESET GPIO lines");
+        close(chip_fd);
+        return -1;
+    }
+    close(chip_fd);
+    
+    gpio_fd = req.fd;
+    gpio_lines = req.lines;
+    memset(&gpio_values, 0, sizeof(gpio_values));
+    memcpy(gpio_values.values, req.default_values, gpio_lines);
+    return 0;
+}
+
+int spi_open(const char *device, const spi_config_t *cfg) {
+    spi_fd = open(device, O_RDWR);
+    if (spi_fd < 0) {
+        perror("Failed to open SPI device");
+        return -1;
+    }
+    
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits = 8;
+    spi_speed = cfg->speed_hz ? cfg->speed_hz : SPI_SPEED_DEFAULT;
+    
+    if (ioctl(spi_fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+        ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+        ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &spi_speed) < 0) {
+        perror("Failed to configure SPI device");
+        spi_close();
+        return -1;
+    }
+    
+    spi_bufsiz = read_spidev_bufsiz();
+    
+    if (gpio_open(cfg) < 0) {
+        spi_close();
+        return -1;
+    }
+    
+    return 0;
+}
+
+void spi_close(void) {
+    if (gpio_fd >= 0) {
+        close(gpio_fd);
+        gpio_fd = -1;
+    }
+    if (spi_fd >= 0) {
+        close(spi_fd);
+        spi_fd = -1;
+    }
+    gpio_lines = 0;
+}
+
+void spi_reset(void) {
+    if (gpio_lines <= GPIO_RESET) return;
+    
+    gpio_set(GPIO_RESET, 0);
+    usleep(10000);
+    gpio_set(GPIO_RESET, 1);
+    usleep(120000);
+}
+
+static int spi_transfer(const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t chunk = len < spi_bufsiz ? len : spi_bufsiz;
+        struct spi_ioc_transfer xfer;
+        
+        memset(&xfer, 0, sizeof(xfer));
+        xfer.tx_buf = (unsigned long)data;
+        xfer.len = chunk;
+        xfer.speed_hz = spi_speed;
+        xfer.bits_per_word = 8;
+        
+        if (ioctl(spi_fd, SPI_IOC_MESSAGE(1), &xfer) < 0) {
+            return -1;
+        }
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+int spi_command(uint8_t cmd, const uint8_t *params, size_t len) {
+    if (spi_fd < 0) return -1;
+    
+    if (gpio_set(GPIO_DC, 0) < 0 || spi_transfer(&cmd, 1) < 0) {
+        return -1;
+    }
+    if (len > 0) {
+        return spi_data(params, len);
+    }
+    return 0;
+}
+
+int spi_data(const uint8_t *data, size_t len) {
+    if (spi_fd < 0) return -1;
+    
+    if (gpio_set(GPIO_DC, 1) < 0) {
+        return -1;
+    }
+    return spi_transfer(data, len);
+}
+
+size_t spi_max_transfer(void) {
+    return spi_bufsiz;
+}
@@ -0,0 +1,280 @@
+#include "ssdsplash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+extern display_config_t current_config;
+
+static void show_help(const char *progname) {
+    printf("Usage: %s [OPTIONS] IMAGE\n", progname);
+    printf("Pre-render an image into an ssdsplash splash file for one display type.\n");
+    printf("Animated GIFs become delta-encoded .ssda animations (monochrome displays only).\n\n");
+    printf("Options:\n");
+    printf("  -t, --type TYPE        Display type: 128x64, 128x32, ili9341, ssh1106 (default: 128x64)\n");
+    printf("  -s, --scaled           Scale image to fit screen\n");
+    printf("  -d, --dither MODE      Dithering on monochrome displays: bayer (default), floyd, atkinson\n");
+    printf("  -o, --output FILE      Output file (default: IMAGE with .ssdi or .ssda extension)\n");
+    printf("  -h, --help             Show this help\n\n");
+    printf("Example:\n");
+    printf("  %s -t 128x64 -s -d atkinson -o /usr/share/ssdsplash/logo.ssdi logo.png\n", progname);
+    printf("  ssdsplash-send -t img /usr/share/ssdsplash/logo.ssdi\n");
+    printf("  %s -t 128x64 -s -o /usr/share/ssdsplash/spinner.ssda spinner.gif\n", progname);
+    printf("  ssdsplash-send -t anim /usr/share/ssdsplash/spinner.ssda\n");
+}
+
+static int write_splash(const char *path) {
+    size_t size = display_snapshot_size();
+    uint8_t *pixels = malloc(size);
+    if (!pixels) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    display_save_snapshot(pixels);
+    
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        free(pixels);
+        return -1;
+    }
+    
+    splash_image_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPLASH_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = SPLASH_IMAGE_VERSION;
+    header.format = current_config.format;
+    header.width = current_config.width;
+    header.height = current_config.height;
+    header.data_offset = sizeof(header);
+    header.data_size = size;
+    
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(pixels, size, 1, f) == 1;
+    free(pixels);
+    
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        remove(path);
+        return -1;
+    }
+    
+    printf("Wrote %s (%zu bytes, %dx%d)\n", path, sizeof(header) + size, header.width, header.height);
+    return 0;
+}
+
+// A new span costs a window command and an I2C segment, about as much as
+// resending this many unchanged columns
+#define SPAN_MERGE_GAP 8
+
+// Writes spans covering the columns of one page that differ between prev
+// and cur, or the whole page if prev is NULL. Returns the span count.
+static int write_page_spans(FILE *f, int page, const uint8_t *prev, const uint8_t *cur) {
+    int width = current_config.width;
+    int count = 0;
+    
+    for (int x = 0; x < width; ) {
+        if (prev && prev[x] == cur[x]) {
+            x++;
+            continue;
+        }
+        
+        int first = x;
+        int last = x;
+        for (x++; x < width && x - last <= SPAN_MERGE_GAP; x++) {
+            if (!prev || prev[x] != cur[x]) last = x;
+        }
+        
+        splash_span_t span = { page, first, last - first + 1, SPLASH_SPAN_CONTROL };
+        fwrite(&span, sizeof(span), 1, f);
+        fwrite(cur + first, span.len, 1, f);
+        x = last + 1;
+        count++;
+    }
+    return count;
+}
+
+// Writes the spans changing frame prev into frame cur (prev NULL for a full
+// redraw) and fills in their index entry
+static void write_frame(FILE *f, const uint8_t *prev, const uint8_t *cur, int delay, splash_frame_t *entry) {
+    int width = current_config.width;
+    
+    entry->offset = ftell(f);
+    entry->span_count = 0;
+    for (int page = 0; page < current_config.pages; page++) {
+        entry->span_count += write_page_spans(f, page, prev ? prev + page * width : NULL, cur + page * width);
+    }
+    entry->size = ftell(f) - entry->offset;
+    entry->delay = delay > UINT16_MAX ? UINT16_MAX : delay;
+}
+
+static int write_animation(const char *path, const image_animation_t *anim) {
+    int count = anim->frame_count;
+    
+    if (count > UINT16_MAX) {
+        fprintf(stderr, "Animation has %d frames, at most %d fit in an .ssda file\n", count, UINT16_MAX);
+        return -1;
+    }
+    
+    splash_frame_t *index = calloc(count + 1, sizeof(*index));
+    if (!index) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        free(index);
+        return -1;
+    }
+    
+    splash_animation_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPLASH_ANIMATION_MAGIC, sizeof(header.magic));
+    header.version = SPLASH_ANIMATION_VERSION;
+    header.format = current_config.format;
+    header.width = current_config.width;
+    header.height = current_config.height;
+    header.frame_count = count;
+    header.index_offset = sizeof(header);
+    
+    // Spans follow the index, which is written once their offsets are known
+    fseek(f, header.index_offset + (count + 1) * sizeof(*index), SEEK_SET);
+    for (int i = 0; i < count; i++) {
+        const uint8_t *prev = i > 0 ? anim->frames + (i - 1) * anim->frame_size : NULL;
+        write_frame(f, prev, anim->frames + i * anim->frame_size, anim->delays[i], &index[i]);
+    }
+    write_frame(f, anim->frames + (count - 1) * anim->frame_size, anim->frames, 0, &index[count]);
+    long size = ftell(f);
+    
+    rewind(f);
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(index, sizeof(*index), count + 1, f) == (size_t)count + 1;
+    
+    size_t delta_bytes = 0;
+    for (int i = 1; i <= count; i++) {
+        delta_bytes += index[i].size;
+    }
+    free(index);
+    
+    if (ferror(f) || fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        remove(path);
+        return -1;
+    }
+    
+    printf("Wrote %s (%ld bytes, %dx%d, %d frames, %zu bytes per frame change on average)\n",
+           path, size, header.width, header.height, count, delta_bytes / count);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    display_type_t display_type = DISPLAY_128x64;
+    bool scaled = false;
+    dither_mode_t dither = DITHER_BAYER;
+    const char *output = NULL;
+    
+    struct option long_options[] = {
+        {"type", required_argument, 0, 't'},
+        {"scaled", no_argument, 0, 's'},
+        {"dither", required_argument, 0, 'd'},
+        {"output", required_argument, 0, 'o'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    
+    while ((opt = getopt_long(argc, argv, "t:sd:o:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                if (strcmp(optarg, "128x32") == 0) {
+                    display_type = DISPLAY_128x32;
+                } else if (strcmp(optarg, "128x64") == 0) {
+                    display_type = DISPLAY_128x64;
+                } else if (strcmp(optarg, "ili9341") == 0) {
+                    display_type = DISPLAY_ILI9341_240x320;
+                } else if (strcmp(optarg, "ssh1106") == 0) {
+                    display_type = DISPLAY_SSH1106_128x64;
+                } else {
+                    fprintf(stderr, "Invalid display type: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                scaled = true;
+                break;
+            case 'd':
+                if (strcmp(optarg, "bayer") == 0) {
+                    dither = DITHER_BAYER;
+                } else if (strcmp(optarg, "floyd") == 0 || strcmp(optarg, "floyd-steinberg") == 0) {
+                    dither = DITHER_FLOYD_STEINBERG;
+                } else if (strcmp(optarg, "atkinson") == 0) {
+                    dither = DITHER_ATKINSON;
+                } else {
+                    fprintf(stderr, "Invalid dither mode: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'h':
+                show_help(argv[0]);
+                return 0;
+            default:
+                show_help(argv[0]);
+                return 1;
+        }
+    }
+    
+    if (optind >= argc) {
+        fprintf(stderr, "Error: Image file is required\n");
+        return 1;
+    }
+    const char *image_path = argv[optind];
+    
+    if (display_init_offscreen(display_type) < 0) {
+        fprintf(stderr, "Failed to set up framebuffer\n");
+        return 1;
+    }
+    
+    decoded_image_t img;
+    if (image_decode_animation(image_path, &img) < 0) {
+        display_cleanup();
+        return 1;
+    }
+    
+    bool animated = img.frames > 1;
+    if (animated && current_config.format != PIXEL_FORMAT_MONO) {
+        fprintf(stderr, "Animations can only be pre-rendered for monochrome displays;\n"
+                        "send the GIF itself with ssdsplash-send -t anim\n");
+        image_release(&img);
+        display_cleanup();
+        return 1;
+    }
+    
+    char default_output[SSDSPLASH_MAX_PATH_LEN];
+    if (!output) {
+        const char *dot = strrchr(image_path, '.');
+        int stem = dot && !strchr(dot, '/') ? dot - image_path : (int)strlen(image_path);
+        snprintf(default_output, sizeof(default_output), "%.*s%s", stem, image_path, animated ? ".ssda" : ".ssdi");
+        output = default_output;
+    }
+    
+    int ret;
+    if (animated) {
+        image_animation_t anim;
+        ret = image_render_animation(&img, scaled, dither, &anim);
+        if (ret < 0) {
+            fprintf(stderr, "Out of memory\n");
+        } else {
+            ret = write_animation(output, &anim);
+            image_animation_release(&anim);
+        }
+    } else {
+        image_render(&img, scaled, dither);
+        ret = write_splash(output);
+    }
+    image_release(&img);
+    display_cleanup();
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+#define STB_TRUETYPE_IMPLEMENTATION
+#include "stb_truetype.h"
+#include "ssdsplash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#define MAX_SIZES 16
+#define MAX_RANGES 32
+#define KERN_SCAN_LIMIT 1024     // glyphs probed pairwise for GPOS-only fonts
+#define MAX_CODEPOINT 0x10FFFF
+
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} codepoint_range_t;
+
+typedef struct {
+    font_atlas_size_t info;
+    font_atlas_glyph_t *glyphs;
+    uint8_t **bits;
+    font_atlas_kern_t *kerns;
+} atlas_size_t;
+
+// Kerning pair in font units, shared by every size
+typedef struct {
+    uint32_t left;
+    uint32_t right;
+    int units;
+} kern_pair_t;
+
+static void show_help(const char *progname) {
+    printf("Usage: %s [OPTIONS] FONT.ttf\n", progname);
+    printf("Pre-rasterize a TrueType font into an ssdsplash font atlas\n\n");
+    printf("Options:\n");
+    printf("  -s, --sizes LIST       Pixel sizes, comma separated (default: 12)\n");
+    printf("  -c, --chars LIST       Codepoint ranges, e.g. 32-126,176 (default: 32-126,160-255)\n");
+    printf("  -o, --output FILE      Output file (default: FONT with .ssdf extension)\n");
+    printf("  -h, --help             Show this help\n\n");
+    printf("Example:\n");
+    printf("  %s -s 12,16 -o /usr/share/ssdsplash/dejavu.ssdf DejaVuSans.ttf\n", progname);
+    printf("  ssdsplash-send -t text -f /usr/share/ssdsplash/dejavu.ssdf -z 16 \"Booting\"\n");
+}
+
+static int parse_sizes(const char *list, int *sizes) {
+    int count = 0;
+    const char *p = list;
+    
+    while (*p && count < MAX_SIZES) {
+        char *end;
+        long size = strtol(p, &end, 10);
+        if (end == p || size <= 0 || size > 255) return -1;
+        if (*end && *end != ',') return -1;
+        sizes[count++] = size;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+// Ranges are bounded to Unicode, so iterating first..last always ends
+static int parse_ranges(const char *list, codepoint_range_t *ranges) {
+    int count = 0;
+    const char *p = list;
+    
+    while (*p && count < MAX_RANGES) {
+        char *end;
+        unsigned long first = strtoul(p, &end, 0);
+        unsigned long last = first;
+        if (end == p) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 0);
+            if (end == p || last < first) return -1;
+        }
+        if (last > MAX_CODEPOINT) return -1;
+        if (*end && *end != ',') return -1;
+        ranges[count].first = first;
+        ranges[count].last = last;
+        count++;
+        p = *end == ',' ? end + 1 : end;
+    }
+    // More than MAX_RANGES entries
+    if (*p) return -1;
+    return count;
+}
+
+static int compare_codepoints(const void *a, const void *b) {
+    const uint32_t *x = a;
+    const uint32_t *y = b;
+    return (*x > *y) - (*x < *y);
+}
+
+// Rasterizes every present codepoint at one size with the same threshold
+// the daemon applies to TrueType glyphs.
+static int render_size(const stbtt_fontinfo *font, int pixel_size, const uint32_t *codepoints, int count,
+                       const kern_pair_t *pairs, int pair_count, atlas_size_t *out) {
+    float scale = stbtt_ScaleForPixelHeight(font, pixel_size);
+    int ascent, descent, line_gap;
+    stbtt_GetFontVMetrics(font, &ascent, &descent, &line_gap);
+    
+    out->info.pixel_size = pixel_size;
+    out->info.ascent = (int)(ascent * scale);
+    out->info.glyph_count = 0;
+    out->glyphs = calloc(count, sizeof(*out->glyphs));
+    out->bits = calloc(count, sizeof(*out->bits));
+    if (!out->glyphs || !out->bits) return -1;
+    
+    for (int i = 0; i < count; i++) {
+        int glyph_index = stbtt_FindGlyphIndex(font, codepoints[i]);
+        if (glyph_index == 0) continue;
+        
+        int width = 0, height = 0, xoff = 0, yoff = 0;
+        unsigned char *bitmap = stbtt_GetGlyphBitmap(font, scale, scale, glyph_index, &width, &height, &xoff, &yoff);
+        int advance_width, left_side_bearing;
+        stbtt_GetGlyphHMetrics(font, glyph_index, &advance_width, &left_side_bearing);
+        
+        font_atlas_glyph_t *g = &out->glyphs[out->info.glyph_count];
+        g->codepoint = codepoints[i];
+        g->width = bitmap ? width : 0;
+        g->height = bitmap ? height : 0;
+        g->xoff = xoff;
+        g->yoff = yoff;
+        g->advance = (int)(advance_width * scale);
+        
+        size_t bytes = ((g->height + 7) / 8) * g->width;
+        uint8_t *bits = calloc(bytes ? bytes : 1, 1);
+        if (!bits) {
+            stbtt_FreeBitmap(bitmap, NULL);
+            return -1;
+        }
+        for (int py = 0; py < g->height; py++) {
+            for (int px = 0; px < g->width; px++) {
+                if (bitmap[py * width + px] > 127) bits[(py / 8) * width + px] |= 1 << (py % 8);
+            }
+        }
+        stbtt_FreeBitmap(bitmap, NULL);
+        
+        out->bits[out->info.glyph_count++] = bits;
+    }
+    
+    // Rounded the same way the daemon rounds TrueType kerning
+    out->kerns = calloc(pair_count ? pair_count : 1, sizeof(*out->kerns));
+    if (!out->kerns) return -1;
+    for (int i = 0; i < pair_count; i++) {
+        int adjust = (int)floorf(pairs[i].units * scale + 0.5f);
+        if (adjust == 0) continue;
+        
+        font_atlas_kern_t *k = &out->kerns[out->info.kern_count++];
+        k->left = pairs[i].left;
+        k->right = pairs[i].right;
+        k->adjust = adjust;
+    }
+    return 0;
+}
+
+// Glyph index of one atlas codepoint, sorted by glyph so kerning table
+// entries can be mapped back to every codepoint sharing that glyph
+typedef struct {
+    int glyph;
+    uint32_t codepoint;
+} glyph_codepoint_t;
+
+static int compare_glyph_codepoints(const void *a, const void *b) {
+    const glyph_codepoint_t *x = a;
+    const glyph_codepoint_t *y = b;
+    if (x->glyph != y->glyph) return (x->glyph > y->glyph) - (x->glyph < y->glyph);
+    return (x->codepoint > y->codepoint) - (x->codepoint < y->codepoint);
+}
+
+static int compare_kern_pairs(const void *a, const void *b) {
+    const kern_pair_t *x = a;
+    const kern_pair_t *y = b;
+    if (x->left != y->left) return (x->left > y->left) - (x->left < y->left);
+    return (x->right > y->right) - (x->right < y->right);
+}
+
+// First entry of map with the given glyph, or count if none
+static int find_glyph(const glyph_codepoint_t *map, int count, int glyph) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (map[mid].glyph < glyph) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < count && map[lo].glyph == glyph ? lo : count;
+}
+
+static int add_kern_pair(kern_pair_t **pairs, int *pair_count, int *capacity, uint32_t left, uint32_t right, int units) {
+    if (*pair_count == *capacity) {
+        *capacity *= 2;
+        kern_pair_t *grown = realloc(*pairs, *capacity * sizeof(**pairs));
+        if (!grown) return -1;
+        *pairs = grown;
+    }
+    (*pairs)[*pair_count].left = left;
+    (*pairs)[*pair_count].right = right;
+    (*pairs)[*pair_count].units = units;
+    (*pair_count)++;
+    return 0;
+}
+
+// Collects every non-zero kerning pair between the atlas codepoints, sorted
+// by (left, right) for the daemon's binary search. Fonts with a 'kern'
+// table are walked entry by entry; each value still comes from
+// stbtt_GetGlyphKernAdvance() so it matches what the daemon applies.
+// GPOS-only fonts have no pair list stb_truetype can enumerate, so they
+// are probed pairwise, which is quadratic and only done for up to
+// KERN_SCAN_LIMIT codepoints.
+static int collect_kerning(const stbtt_fontinfo *font, const uint32_t *codepoints, int count, kern_pair_t **pairs) {
+    glyph_codepoint_t *map = malloc((count ? count : 1) * sizeof(*map));
+    int capacity = 256, pair_count = 0;
+    *pairs = malloc(capacity * sizeof(**pairs));
+    if (!map || !*pairs) return -1;
+    
+    int mapped = 0;
+    for (int i = 0; i < count; i++) {
+        int glyph = stbtt_FindGlyphIndex(font, codepoints[i]);
+        if (glyph == 0) continue;
+        map[mapped].glyph = glyph;
+        map[mapped].codepoint = codepoints[i];
+        mapped++;
+    }
+    qsort(map, mapped, sizeof(*map), compare_glyph_codepoints);
+    
+    int table_length = stbtt_GetKerningTableLength(font);
+    if (table_length > 0) {
+        stbtt_kerningentry *table = malloc(table_length * sizeof(*table));
+        if (!table) return -1;
+        table_length = stbtt_GetKerningTable(font, table, table_length);
+        
+        for (int k = 0; k < table_length; k++) {
+            int l0 = find_glyph(map, mapped, table[k].glyph1);
+            int r0 = find_glyph(map, mapped, table[k].glyph2);
+            if (l0 == mapped || r0 == mapped) continue;
+            
+            int units = stbtt_GetGlyphKernAdvance(font, table[k].glyph1, table[k].glyph2);
+            if (units == 0) continue;
+            
+            for (int l = l0; l < mapped && map[l].glyph == table[k].glyph1; l++) {
+                for (int r = r0; r < mapped && map[r].glyph == table[k].glyph2; r++) {
+                    if (add_kern_pair(pairs, &pair_count, &capacity, map[l].codepoint, map[r].codepoint, units) < 0) {
+                        free(table);
+                        return -1;
+                    }
+                }
+            }
+        }
+        free(table);
+    } else if (font->gpos && mapped > KERN_SCAN_LIMIT) {
+        fprintf(stderr, "Warning: font has GPOS kerning only; skipping it for more than %d glyphs\n",
+                KERN_SCAN_LIMIT);
+    } else if (font->gpos) {
+        for (int l = 0; l < mapped; l++) {
+            for (int r = 0; r < mapped; r++) {
+                int units = stbtt_GetGlyphKernAdvance(font, map[l].glyph, map[r].glyph);
+                if (units == 0) continue;
+                if (add_kern_pair(pairs, &pair_count, &capacity, map[l].codepoint, map[r].codepoint, units) < 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    
+    qsort(*pairs, pair_count, sizeof(**pairs), compare_kern_pairs);
+    free(map);
+    return pair_count;
+}
+
+static int write_atlas(const char *path, atlas_size_t *sizes, int size_count) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    
+    // Layout: header, size table, each size's glyph and kerning tables,
+    // then bitmaps
+    font_atlas_header_t header;
+    memcpy(header.magic, FONT_ATLAS_MAGIC, sizeof(header.magic));
+    header.version = FONT_ATLAS_VERSION;
+    header.size_count = size_count;
+    
+    uint32_t offset = sizeof(header) + size_count * sizeof(font_atlas_size_t);
+    for (int s = 0; s < size_count; s++) {
+        sizes[s].info.glyph_offset = offset;
+        offset += sizes[s].info.glyph_count * sizeof(font_atlas_glyph_t);
+        sizes[s].info.kern_offset = offset;
+        offset += sizes[s].info.kern_count * sizeof(font_atlas_kern_t);
+    }
+    for (int s = 0; s < size_count; s++) {
+        for (uint32_t i = 0; i < sizes[s].info.glyph_count; i++) {
+            font_atlas_glyph_t *g = &sizes[s].glyphs[i];
+            g->bits_offset = offset;
+            offset += ((g->height + 7) / 8) * g->width;
+        }
+    }
+    
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (int s = 0; s < size_count && ok; s++) {
+        ok = fwrite(&sizes[s].info, sizeof(sizes[s].info), 1, f) == 1;
+    }
+    for (int s = 0; s < size_count && ok; s++) {
+        size_t n = sizes[s].info.glyph_count;
+        ok = fwrite(sizes[s].glyphs, sizeof(font_atlas_glyph_t), n, f) == n;
+        n = sizes[s].info.kern_count;
+        ok = ok && fwrite(sizes[s].kerns, sizeof(font_atlas_kern_t), n, f) == n;
+    }
+    for (int s = 0; s < size_count && ok; s++) {
+        for (uint32_t i = 0; i < sizes[s].info.glyph_count && ok; i++) {
+            const font_atlas_glyph_t *g = &sizes[s].glyphs[i];
+            size_t bytes = ((g->height + 7) / 8) * g->width;
+            ok = bytes == 0 || fwrite(sizes[s].bits[i], bytes, 1, f) == 1;
+        }
+    }
+    
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        remove(path);
+        return -1;
+    }
+    
+    printf("Wrote %s (%u bytes, %d sizes)\n", path, offset, size_count);
+    return 0;
+}
+
+static unsigned char *read_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    
+    unsigned char *data = size > 0 ? malloc(size) : NULL;
+    if (data && fread(data, 1, size, f) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    const char *size_list = "12";
+    const char *char_list = "32-126,160-255";
+    const char *output = NULL;
+    
+    struct option long_options[] = {
+        {"sizes", required_argument, 0, 's'},
+        {"chars", required_argument, 0, 'c'},
+        {"output", required_argument, 0, 'o'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    
+    while ((opt = getopt_long(argc, argv, "s:c:o:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                size_list = optarg;
+                break;
+            case 'c':
+                char_list = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'h':
+                show_help(argv[0]);
+                return 0;
+            default:
+                show_help(argv[0]);
+                return 1;
+        }
+    }
+    
+    if (optind >= argc) {
+        fprintf(stderr, "Error: Font file is required\n");
+        return 1;
+    }
+    const char *font_path = argv[optind];
+    
+    int sizes[MAX_SIZES];
+    int size_count = parse_sizes(size_list, sizes);
+    if (size_count <= 0) {
+        fprintf(stderr, "Invalid size list: %s\n", size_list);
+        return 1;
+    }
+    
+    codepoint_range_t ranges[MAX_RANGES];
+    int range_count = parse_ranges(char_list, ranges);
+    if (range_count <= 0) {
+        fprintf(stderr, "Invalid codepoint list: %s\n", char_list);
+        return 1;
+    }
+    
+    int codepoint_count = 0;
+    for (int r = 0; r < range_count; r++) {
+        codepoint_count += ranges[r].last - ranges[r].first + 1;
+    }
+    uint32_t *codepoints = malloc(codepoint_count * sizeof(*codepoints));
+    if (!codepoints) return 1;
+    
+    int n = 0;
+    for (int r = 0; r < range_count; r++) {
+        for (uint32_t cp = ranges[r].first; cp <= ranges[r].last; cp++) {
+            codepoints[n++] = cp;
+        }
+    }
+    qsort(codepoints, n, sizeof(*codepoints), compare_codepoints);
+    
+    // Drop duplicates from overlapping ranges; lookups binary search
+    int unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (unique == 0 || codepoints[i] != codepoints[unique - 1]) codepoints[unique++] = codepoints[i];
+    }
+    
+    unsigned char *font_data = read_file(font_path);
+    stbtt_fontinfo font;
+    if (!font_data || !stbtt_InitFont(&font, font_data, 0)) {
+        fprintf(stderr, "Failed to load font: %s\n", font_path);
+        return 1;
+    }
+    
+    char default_output[SSDSPLASH_MAX_PATH_LEN];
+    if (!output) {
+        const char *dot = strrchr(font_path, '.');
+        int stem = dot && !strchr(dot, '/') ? dot - font_path : (int)strlen(font_path);
+        snprintf(default_output, sizeof(default_output), "%.*s.ssdf", stem, font_path);
+        output = default_output;
+    }
+    
+    kern_pair_t *pairs;
+    int pair_count = collect_kerning(&font, codepoints, unique, &pairs);
+    if (pair_count < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    
+    atlas_size_t atlas[MAX_SIZES];
+    memset(atlas, 0, sizeof(atlas));
+    for (int s = 0; s < size_count; s++) {
+        if (render_size(&font, sizes[s], codepoints, unique, pairs, pair_count, &atlas[s]) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+    
+    return write_atlas(output, atlas, size_count) < 0 ? 1 : 0;
+}
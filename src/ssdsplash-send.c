@@ -13,16 +13,25 @@ static void show_help(const char *progname) {
     printf("Usage: %s [OPTIONS]\n", progname);
     printf("Send commands to ssdsplash daemon\n\n");
     printf("Options:\n");
-    printf("  -t, --type TYPE        Message type: text, progress, clear, quit, img\n");
+    printf("  -t, --type TYPE        Message type: text, progress, clear, quit, img, anim,\n");
+    printf("                         preload, commit\n");
     printf("  -f, --font FONT        Font file (.ttf) for text type\n");
     printf("  -z, --size SIZE        Font size in pixels (default: 12)\n");
     printf("  -v, --value VALUE      Progress value (for progress type)\n");
     printf("  -m, --max MAX          Maximum value (for progress type, default: 100)\n");
     printf("  -l, --line LINE        Text line number (for text type, default: 0)\n");
-    printf("  -s, --scaled           Scale image to fit screen (for img type)\n");
+    printf("  -s, --scaled           Scale image to fit screen (for img, anim and preload types)\n");
+    printf("  -d, --dither MODE      Dithering for images on monochrome displays:\n");
+    printf("                         bayer (default), floyd, atkinson\n");
+    printf("  -n, --loops N          Times to play an animation (for anim type, default: forever)\n");
+    printf("  -S, --stream           Read one command per line from stdin over one connection\n");
+    printf("  -D, --datagram         Fire-and-forget: send as a datagram without waiting\n");
     printf("  -h, --help             Show this help\n");
-    printf("  TEXT/PATH [ARGS...]    Text message (for text type) or image path (for img type)\n");
-    printf("                         For text: supports printf-style format strings with args\n\n");
+    printf("  TEXT/PATH [ARGS...]    Text message (for text type) or image path\n");
+    printf("                         (for img, anim and preload types)\n");
+    printf("                         For text: supports printf-style format strings with args\n");
+    printf("  X,Y,W,H                Region to flush from the shared framebuffer (for commit type,\n");
+    printf("                         default: whole screen)\n\n");
     printf("Examples:\n");
     printf("  %s -t text \"Loading configuration...\"\n", progname);
     printf("  %s -t text -f /path/to/font.ttf -z 16 \"TrueType Text\"\n", progname);
@@ -33,8 +42,14 @@ static void show_help(const char *progname) {
     printf("  %s -t progress -v 50 -m 200\n", progname);
     printf("  %s -t img /path/to/logo.png\n", progname);
     printf("  %s -t img -s /path/to/splash.jpg\n", progname);
+    printf("  %s -t img -s -d atkinson /path/to/photo.jpg\n", progname);
+    printf("  %s -t anim -s -n 3 /path/to/spinner.gif\n", progname);
+    printf("  %s -t preload -s /path/to/splash.jpg\n", progname);
+    printf("  %s -t commit 0,16,128,8\n", progname);
     printf("  %s -t clear\n", progname);
     printf("  %s -t quit\n", progname);
+    printf("  %s -D -t progress -v 42\n", progname);
+    printf("  printf '%%s\\n' '-t text Booting' '-t progress -v 10' | %s --stream\n", progname);
 }
 
 static int format_text_with_args(char *output, size_t output_size, const char *format, int argc, char *argv[], int start_idx) {
@@ -144,11 +159,11 @@ static int format_text_with_args(char *output, size_t output_size, const char *f
     return 0;
 }
 
-static int send_message(const ssdsplash_message_t *msg) {
+static int connect_daemon(bool datagram) {
     int sock_fd;
     struct sockaddr_un addr;
     
-    sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sock_fd = socket(AF_UNIX, datagram ? SOCK_DGRAM : SOCK_STREAM, 0);
     if (sock_fd < 0) {
         perror("socket");
         return -1;
@@ -156,7 +171,8 @@ static int send_message(const ssdsplash_message_t *msg) {
     
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SSDSPLASH_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    strncpy(addr.sun_path, datagram ? SSDSPLASH_DGRAM_SOCKET_PATH : SSDSPLASH_SOCKET_PATH,
+            sizeof(addr.sun_path) - 1);
     
     if (connect(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("connect");
@@ -165,17 +181,42 @@ static int send_message(const ssdsplash_message_t *msg) {
         return -1;
     }
     
-    if (send(sock_fd, msg, sizeof(*msg), 0) != sizeof(*msg)) {
+    return sock_fd;
+}
+
+// datagram must match the socket connect_daemon() returned
+static int write_message(int sock_fd, const ssdsplash_message_t *msg, bool datagram) {
+    uint8_t frame[SSDSPLASH_MAX_FRAME];
+    int len = protocol_encode(msg, frame, sizeof(frame));
+    
+    if (len < 0) {
+        fprintf(stderr, "Error: Message too large\n");
+        return -1;
+    }
+    // Datagrams never wait for the daemon; a full queue drops the update
+    int flags = MSG_NOSIGNAL | (datagram ? MSG_DONTWAIT : 0);
+    if (send(sock_fd, frame, len, flags) != len) {
         perror("send");
-        close(sock_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static int send_message(const ssdsplash_message_t *msg, bool datagram) {
+    int sock_fd = connect_daemon(datagram);
+    if (sock_fd < 0) {
         return -1;
     }
     
+    int ret = write_message(sock_fd, msg, datagram);
     close(sock_fd);
-    return 0;
+    return ret;
 }
 
-int main(int argc, char *argv[]) {
+// Parses command line style arguments into msg. Returns 0 on success,
+// 1 if help was requested, -1 on error. *stream and *datagram are set if
+// --stream or --datagram was given.
+static int build_message(int argc, char *argv[], ssdsplash_message_t *msg, bool *stream, bool *datagram) {
     int opt;
     char *type = NULL;
     char *font_path = NULL;
@@ -184,7 +225,8 @@ int main(int argc, char *argv[]) {
     int max_value = 100;
     int line = 0;
     bool scaled = false;
-    ssdsplash_message_t msg = {0};
+    dither_mode_t dither = DITHER_BAYER;
+    int loops = 0;
     
     struct option long_options[] = {
         {"type", required_argument, 0, 't'},
@@ -194,11 +236,20 @@ int main(int argc, char *argv[]) {
         {"max", required_argument, 0, 'm'},
         {"line", required_argument, 0, 'l'},
         {"scaled", no_argument, 0, 's'},
+        {"dither", required_argument, 0, 'd'},
+        {"loops", required_argument, 0, 'n'},
+        {"stream", no_argument, 0, 'S'},
+        {"datagram", no_argument, 0, 'D'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
     
-    while ((opt = getopt_long(argc, argv, "t:f:z:v:m:l:sh", long_options, NULL)) != -1) {
+    memset(msg, 0, sizeof(*msg));
+    *stream = false;
+    *datagram = false;
+    optind = 0;
+    
+    while ((opt = getopt_long(argc, argv, "t:f:z:v:m:l:sd:n:SDh", long_options, NULL)) != -1) {
         switch (opt) {
             case 't':
                 type = optarg;
@@ -221,76 +272,221 @@ int main(int argc, char *argv[]) {
             case 's':
                 scaled = true;
                 break;
+            case 'd':
+                if (strcmp(optarg, "bayer") == 0) {
+                    dither = DITHER_BAYER;
+                } else if (strcmp(optarg, "floyd") == 0 || strcmp(optarg, "floyd-steinberg") == 0) {
+                    dither = DITHER_FLOYD_STEINBERG;
+                } else if (strcmp(optarg, "atkinson") == 0) {
+                    dither = DITHER_ATKINSON;
+                } else {
+                    fprintf(stderr, "Error: Invalid dither mode: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'n':
+                loops = atoi(optarg);
+                break;
+            case 'S':
+                *stream = true;
+                break;
+            case 'D':
+                *datagram = true;
+                break;
             case 'h':
-                show_help(argv[0]);
-                return 0;
-            default:
-                show_help(argv[0]);
                 return 1;
+            default:
+                return -1;
         }
     }
     
+    if (*stream) {
+        return 0;
+    }
+    
     if (!type) {
         fprintf(stderr, "Error: Message type (-t) is required\n");
-        show_help(argv[0]);
-        return 1;
+        return -1;
     }
     
     if (strcmp(type, "text") == 0) {
         if (optind >= argc) {
             fprintf(stderr, "Error: Text message is required for text type\n");
-            return 1;
+            return -1;
         }
         
-        msg.type = MSG_TYPE_TEXT;
+        msg->type = MSG_TYPE_TEXT;
         
         char formatted_text[SSDSPLASH_MAX_TEXT_LEN];
         if (format_text_with_args(formatted_text, sizeof(formatted_text), argv[optind], argc, argv, optind + 1) < 0) {
             fprintf(stderr, "Error: Failed to format text\n");
-            return 1;
+            return -1;
         }
         
-        strncpy(msg.data.text_msg.text, formatted_text, SSDSPLASH_MAX_TEXT_LEN - 1);
-        msg.data.text_msg.text[SSDSPLASH_MAX_TEXT_LEN - 1] = '\0';
-        msg.data.text_msg.line = line;
+        strncpy(msg->data.text_msg.text, formatted_text, SSDSPLASH_MAX_TEXT_LEN - 1);
+        msg->data.text_msg.text[SSDSPLASH_MAX_TEXT_LEN - 1] = '\0';
+        msg->data.text_msg.line = line;
         
         if (font_path) {
-            strncpy(msg.data.text_msg.font_path, font_path, SSDSPLASH_MAX_PATH_LEN - 1);
-            msg.data.text_msg.font_path[SSDSPLASH_MAX_PATH_LEN - 1] = '\0';
+            strncpy(msg->data.text_msg.font_path, font_path, SSDSPLASH_MAX_PATH_LEN - 1);
+            msg->data.text_msg.font_path[SSDSPLASH_MAX_PATH_LEN - 1] = '\0';
         } else {
-            msg.data.text_msg.font_path[0] = '\0';
+            msg->data.text_msg.font_path[0] = '\0';
         }
-        msg.data.text_msg.font_size = font_size;
-        
+        msg->data.text_msg.font_size = font_size;
+    
     } else if (strcmp(type, "progress") == 0) {
-        msg.type = MSG_TYPE_PROGRESS;
-        msg.data.progress_msg.value = value;
-        msg.data.progress_msg.max_value = max_value;
-        
+        msg->type = MSG_TYPE_PROGRESS;
+        msg->data.progress_msg.value = value;
+        msg->data.progress_msg.max_value = max_value;
+    
     } else if (strcmp(type, "clear") == 0) {
-        msg.type = MSG_TYPE_CLEAR;
-        
+        msg->type = MSG_TYPE_CLEAR;
+    
     } else if (strcmp(type, "quit") == 0) {
-        msg.type = MSG_TYPE_QUIT;
-        
-    } else if (strcmp(type, "img") == 0) {
+        msg->type = MSG_TYPE_QUIT;
+    
+    } else if (strcmp(type, "img") == 0 || strcmp(type, "anim") == 0 || strcmp(type, "preload") == 0) {
         if (optind >= argc) {
-            fprintf(stderr, "Error: Image path is required for img type\n");
-            return 1;
+            fprintf(stderr, "Error: Image path is required for %s type\n", type);
+            return -1;
         }
         
-        msg.type = MSG_TYPE_IMAGE;
-        strncpy(msg.data.image_msg.path, argv[optind], SSDSPLASH_MAX_PATH_LEN - 1);
-        msg.data.image_msg.path[SSDSPLASH_MAX_PATH_LEN - 1] = '\0';
-        msg.data.image_msg.scaled = scaled;
-        
+        if (strcmp(type, "anim") == 0) {
+            msg->type = MSG_TYPE_ANIMATION;
+        } else if (strcmp(type, "preload") == 0) {
+            msg->type = MSG_TYPE_PRELOAD;
+        } else {
+            msg->type = MSG_TYPE_IMAGE;
+        }
+        strncpy(msg->data.image_msg.path, argv[optind], SSDSPLASH_MAX_PATH_LEN - 1);
+        msg->data.image_msg.path[SSDSPLASH_MAX_PATH_LEN - 1] = '\0';
+        msg->data.image_msg.scaled = scaled;
+        msg->data.image_msg.dither = dither;
+        msg->data.image_msg.loops = loops;
+    
+    } else if (strcmp(type, "commit") == 0) {
+        msg->type = MSG_TYPE_COMMIT;
+        if (optind < argc &&
+            sscanf(argv[optind], "%d,%d,%d,%d", &msg->data.commit_msg.x, &msg->data.commit_msg.y,
+                   &msg->data.commit_msg.width, &msg->data.commit_msg.height) != 4) {
+            fprintf(stderr, "Error: Region must be X,Y,W,H\n");
+            return -1;
+        }
+    
     } else {
         fprintf(stderr, "Error: Invalid message type: %s\n", type);
-        fprintf(stderr, "Valid types: text, progress, clear, quit, img\n");
+        fprintf(stderr, "Valid types: text, progress, clear, quit, img, anim, preload, commit\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Splits a line into words in place. Single or double quotes group words,
+// and a backslash escapes a following quote, backslash or space.
+static int split_line(char *line, char *words[], int max_words) {
+    int count = 0;
+    char *src = line;
+    
+    while (*src) {
+        while (*src == ' ' || *src == '\t') src++;
+        if (*src == '\0' || count == max_words) break;
+        
+        char *dst = src;
+        char quote = 0;
+        words[count++] = dst;
+        
+        while (*src && (quote || (*src != ' ' && *src != '\t'))) {
+            if (quote && *src == quote) {
+                quote = 0;
+                src++;
+            } else if (!quote && (*src == '"' || *src == '\'')) {
+                quote = *src++;
+            } else if (*src == '\\' && src[1] && strchr("\"'\\ ", src[1])) {
+                *dst++ = src[1];
+                src += 2;
+            } else {
+                *dst++ = *src++;
+            }
+        }
+        
+        if (*src) src++;
+        *dst = '\0';
+    }
+    
+    return count;
+}
+
+// Reads one command per line from stdin, using the same options as the
+// command line (e.g. "-t progress -v 42"), and sends them all over a
+// single connection. The transport is chosen once for the whole stream,
+// so lines may not carry --stream or --datagram.
+static int run_stream(const char *progname, bool datagram) {
+    int sock_fd = connect_daemon(datagram);
+    if (sock_fd < 0) {
         return 1;
     }
     
-    if (send_message(&msg) < 0) {
+    char line[SSDSPLASH_MAX_TEXT_LEN + 256];
+    int line_no = 0;
+    int failed = 0;
+    
+    while (fgets(line, sizeof(line), stdin)) {
+        line_no++;
+        
+        // A line longer than the buffer would otherwise run on as a
+        // second command; drop the rest of it instead
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] != '\n') {
+            int c = getchar();
+            if (c != EOF && c != '\n') {
+                while ((c = getchar()) != EOF && c != '\n');
+                fprintf(stderr, "Error: Line %d is too long\n", line_no);
+                failed++;
+                continue;
+            }
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        
+        char *words[64];
+        words[0] = (char *)progname;
+        int count = split_line(line, words + 1, 63) + 1;
+        if (count == 1 || words[1][0] == '#') continue;
+        
+        ssdsplash_message_t msg;
+        bool stream, line_datagram;
+        if (build_message(count, words, &msg, &stream, &line_datagram) != 0 || stream || line_datagram) {
+            fprintf(stderr, "Error: Invalid command on line %d\n", line_no);
+            failed++;
+            continue;
+        }
+        
+        if (write_message(sock_fd, &msg, datagram) < 0) {
+            close(sock_fd);
+            return 1;
+        }
+    }
+    
+    close(sock_fd);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    ssdsplash_message_t msg;
+    bool stream, datagram;
+    
+    int ret = build_message(argc, argv, &msg, &stream, &datagram);
+    if (ret != 0) {
+        show_help(argv[0]);
+        return ret < 0 ? 1 : 0;
+    }
+    
+    if (stream) {
+        return run_stream(argv[0], datagram);
+    }
+    
+    if (send_message(&msg, datagram) < 0) {
         return 1;
     }
     
@@ -4,28 +4,88 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <sys/select.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <errno.h>
 #include <getopt.h>
-#include <pthread.h>
 #include "ssdsplash.h"
 
+extern display_config_t current_config;
+
+#define MAX_CLIENTS 64
+#define MAX_EVENTS 16
+#define DEFAULT_MAX_FPS 30
+#define MAX_READS_PER_WAKEUP 16
+
+typedef struct {
+    int fd;
+    size_t received;
+    uint8_t buf[SSDSPLASH_MAX_FRAME];
+} client_t;
+
+typedef struct image_job {
+    worker_job_t job;
+    char path[SSDSPLASH_MAX_PATH_LEN];
+    bool scaled;
+    dither_mode_t dither;
+    bool animated;
+    int loops;
+    bool show;                  // draw when decoded; preloads only fill the cache
+    image_key_t key;
+    bool cacheable;             // key is valid
+    unsigned long generation;
+    decoded_image_t img;
+    int result;
+    struct image_job *next;     // in image_jobs
+} image_job_t;
+
 static volatile bool running = true;
 static int server_fd = -1;
+static int dgram_fd = -1;
+static int worker_fd = -1;
+static int timer_fd = -1;
+static int epoll_fd = -1;
+static int client_count = 0;
+
+// Image jobs handed to the workers and not yet done, so an image that is
+// already being decoded is not decoded again
+static image_job_t *image_jobs = NULL;
+
+// The newest image or animation to show that found the worker queue full.
+// It is submitted when a worker finishes; older requests are dropped, as
+// they would be stale by the time they were decoded anyway.
+static image_job_t *deferred_job = NULL;
+
+static ssdsplash_message_t pending_scene;
+static bool scene_pending = false;
+static bool frame_pending = false;
+static uint64_t frame_interval_us = 1000000 / DEFAULT_MAX_FPS;
+static uint64_t last_frame_us = 0;
+
+// Bumped by every message that redraws the screen, so a background image
+// decode that finishes after a newer message does not overwrite it.
+static unsigned long scene_generation = 0;
+
+// The animation on screen, if any. Frames are rendered up front and
+// timer_fd fires when the next one is due.
+static image_animation_t animation;
+static int animation_frame = 0;
+static int animation_loops = 0;             // plays left, 0 repeats forever
+static uint64_t animation_due_ns = 0;
 static display_type_t display_type = DISPLAY_128x64;
 static char *device_path = NULL;
 static uint8_t device_address = 0;
+static spi_config_t spi_config = {
+    SPI_SPEED_DEFAULT, SPI_GPIOCHIP_DEFAULT, SPI_DC_LINE_DEFAULT, SPI_RESET_LINE_DEFAULT
+};
 
 static void signal_handler(int sig) {
     (void)sig;
     running = false;
-    if (server_fd >= 0) {
-        close(server_fd);
-        server_fd = -1;
-    }
 }
 
 static void show_help(const char *progname) {
@@ -35,6 +95,15 @@ static void show_help(const char *progname) {
     printf("  -d, --device DEVICE    Device path (default: /dev/i2c-1 for I2C, /dev/spidev0.0 for SPI)\n");
     printf("  -a, --address ADDR     I2C address: 0x3C or 0x3D (default: 0x3C)\n");
     printf("  -t, --type TYPE        Display type: 128x64, 128x32, ili9341, ssh1106 (default: 128x64)\n");
+    printf("  -S, --spi-speed HZ     SPI clock for ili9341 (default: %d)\n", SPI_SPEED_DEFAULT);
+    printf("  -g, --gpiochip PATH    GPIO chip for ili9341 DC/RESET (default: %s)\n", SPI_GPIOCHIP_DEFAULT);
+    printf("  -c, --dc-gpio LINE     GPIO line for ili9341 DC (default: %d)\n", SPI_DC_LINE_DEFAULT);
+    printf("  -r, --reset-gpio LINE  GPIO line for ili9341 RESET, -1 if not wired (default: %d)\n", SPI_RESET_LINE_DEFAULT);
+    printf("  -F, --max-fps FPS      Maximum display refresh rate (default: %d)\n", DEFAULT_MAX_FPS);
+    printf("  -B, --font-budget KB   Memory for cached TrueType font files (default: %d)\n",
+           FONT_CACHE_BUDGET_DEFAULT / 1024);
+    printf("  -I, --image-cache KB   Memory for cached rendered images and animation frames (default: %d)\n",
+           IMAGE_CACHE_BUDGET_DEFAULT / 1024);
     printf("  -h, --help             Show this help\n");
     printf("\nCommands via ssdsplash-send:\n");
     printf("  ssdsplash-send -t text \"Boot message\"\n");
@@ -42,118 +111,733 @@ static void show_help(const char *progname) {
     printf("  ssdsplash-send -t progress -v 50\n");
     printf("  ssdsplash-send -t img /path/to/logo.png\n");
     printf("  ssdsplash-send -t img -s /path/to/splash.jpg\n");
+    printf("  ssdsplash-send -t anim -s /path/to/spinner.gif\n");
+    printf("  ssdsplash-send -t preload -s /path/to/splash.jpg\n");
+    printf("  ssdsplash-send -t commit 0,16,128,8\n");
     printf("  ssdsplash-send -t clear\n");
     printf("  ssdsplash-send -t quit\n");
 }
 
-static int setup_server_socket(void) {
+static int bind_socket(int type, const char *path) {
     struct sockaddr_un addr;
     
-    server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (server_fd < 0) {
+    int fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
         perror("socket");
         return -1;
     }
     
-    unlink(SSDSPLASH_SOCKET_PATH);
+    unlink(path);
     
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SSDSPLASH_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
     
-    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("bind");
-        close(server_fd);
-        server_fd = -1;
+        close(fd);
         return -1;
     }
     
-    if (listen(server_fd, 5) < 0) {
+    return fd;
+}
+
+static int setup_server_socket(void) {
+    server_fd = bind_socket(SOCK_STREAM, SSDSPLASH_SOCKET_PATH);
+    if (server_fd < 0) {
+        return -1;
+    }
+    
+    if (listen(server_fd, MAX_CLIENTS) < 0) {
         perror("listen");
         close(server_fd);
         server_fd = -1;
         return -1;
     }
     
+    // Fire-and-forget endpoint: one message per datagram, no connection
+    dgram_fd = bind_socket(SOCK_DGRAM, SSDSPLASH_DGRAM_SOCKET_PATH);
+    if (dgram_fd < 0) {
+        fprintf(stderr, "Datagram endpoint unavailable\n");
+    }
+    
     return 0;
 }
 
-static void handle_message(const ssdsplash_message_t *msg) {
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Arms timer_fd for the current frame's delay, measured from when the
+// previous frame was due so slow flushes do not stretch the animation
+static void schedule_animation_frame(void) {
+    uint64_t now = now_ns();
+    uint64_t delay = (uint64_t)animation.delays[animation_frame] * 1000000;
+    
+    animation_due_ns = animation_due_ns + delay > now ? animation_due_ns + delay : now + delay;
+    
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = animation_due_ns / 1000000000;
+    its.it_value.tv_nsec = animation_due_ns % 1000000000;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        perror("timerfd_settime");
+    }
+}
+
+static void stop_animation(void) {
+    if (animation.frame_count == 0) return;
+    
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(timer_fd, 0, &its, NULL);
+    image_animation_release(&animation);
+}
+
+// Shows the first frame of the loaded animation and arms the timer for the
+// next one
+static void play_animation(int loops) {
+    animation_frame = 0;
+    animation_loops = loops;
+    animation_due_ns = 0;
+    image_animation_show(&animation, 0);
+    if (timer_fd >= 0 && animation.frame_count > 1) {
+        schedule_animation_frame();
+    } else {
+        image_animation_release(&animation);
+    }
+    scene_pending = false;
+    frame_pending = true;
+}
+
+// Rendered frames are held for as long as the animation plays, so they
+// share the image cache budget (-I): one that does not fit shows its
+// first frame only.
+static void start_animation(const decoded_image_t *img, bool scaled, dither_mode_t dither, int loops) {
+    size_t max_frames = image_get_cache_budget() / display_snapshot_size();
+    
+    if (timer_fd >= 0 && img->frames > 1 && (size_t)img->frames > max_frames) {
+        printf("%d frames exceed the %zu KB image cache budget, showing the first\n",
+               img->frames, image_get_cache_budget() / 1024);
+    } else if (timer_fd >= 0 && img->frames > 1) {
+        if (image_render_animation(img, scaled, dither, &animation) == 0) {
+            play_animation(loops);
+            return;
+        }
+        fprintf(stderr, "Not enough memory for %d frames, showing the first\n", img->frames);
+    }
+    image_render(img, scaled, dither);
+    scene_pending = false;
+    frame_pending = true;
+}
+
+// Shows the next frame. Only the bytes that differ from the previous frame
+// are sent: rendered frames mark just those dirty, and .ssda files store
+// nothing else.
+static void advance_animation(void) {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    if (animation.frame_count == 0) return;
+    
+    if (++animation_frame == animation.frame_count) {
+        animation_frame = 0;
+        if (animation_loops > 0 && --animation_loops == 0) {
+            // Leave the last frame on screen
+            image_animation_release(&animation);
+            return;
+        }
+    }
+    
+    image_animation_show(&animation, animation_frame);
+    frame_pending = true;
+    schedule_animation_frame();
+}
+
+static void image_job_run(worker_job_t *job) {
+    image_job_t *ij = (image_job_t *)job;
+    if (ij->animated) {
+        ij->result = image_decode_animation(ij->path, &ij->img);
+    } else {
+        ij->result = image_decode(ij->path, &ij->img);
+    }
+}
+
+// Renders a preloaded image off screen, straight into the image cache
+static void store_preloaded(const image_job_t *ij) {
+    if (display_begin_offscreen() < 0) {
+        fprintf(stderr, "Not enough memory to preload %s\n", ij->path);
+        return;
+    }
+    image_render(&ij->img, ij->scaled, ij->dither);
+    bool cached = image_cache_store(&ij->key);
+    display_end_offscreen();
+    
+    if (cached) {
+        printf("Preloaded image: %s\n", ij->path);
+    } else {
+        printf("Image cache too small to preload %s\n", ij->path);
+    }
+}
+
+static void image_job_done(worker_job_t *job) {
+    image_job_t *ij = (image_job_t *)job;
+    
+    for (image_job_t **p = &image_jobs; *p; p = &(*p)->next) {
+        if (*p == ij) {
+            *p = ij->next;
+            break;
+        }
+    }
+    
+    if (job->cancelled) {
+        // Shutting down; only release the job
+    } else if (ij->result < 0) {
+        printf("Failed to load image: %s\n", ij->path);
+    } else if (!ij->show) {
+        store_preloaded(ij);
+    } else if (ij->generation == scene_generation) {
+        // Any pending scene predates this image
+        if (ij->animated) {
+            start_animation(&ij->img, ij->scaled, ij->dither, ij->loops);
+        } else {
+            image_render(&ij->img, ij->scaled, ij->dither);
+            if (ij->cacheable) {
+                image_cache_store(&ij->key);
+            }
+            scene_pending = false;
+            frame_pending = true;
+        }
+    } else {
+        printf("Dropping stale image: %s\n", ij->path);
+    }
+    
+    if (ij->result == 0) {
+        image_release(&ij->img);
+    }
+    free(ij);
+}
+
+static image_job_t *new_image_job(const char *path, bool scaled, dither_mode_t dither) {
+    image_job_t *ij = calloc(1, sizeof(*ij));
+    if (!ij) return NULL;
+    
+    ij->job.run = image_job_run;
+    ij->job.done = image_job_done;
+    memcpy(ij->path, path, strnlen(path, sizeof(ij->path) - 1));
+    ij->scaled = scaled;
+    ij->dither = dither;
+    ij->show = true;
+    ij->generation = scene_generation;
+    return ij;
+}
+
+// Hands ij to the workers; if they cannot take it, ij is freed
+static int submit_image_job(image_job_t *ij) {
+    if (worker_submit(&ij->job) < 0) {
+        free(ij);
+        return -1;
+    }
+    ij->next = image_jobs;
+    image_jobs = ij;
+    return 0;
+}
+
+// Decodes an image or animation to show without blocking the main loop.
+// Only when there is no worker at all is it decoded inline.
+static void queue_show_job(image_job_t *ij) {
+    if (worker_fd < 0) {
+        image_job_run(&ij->job);
+        image_job_done(&ij->job);
+        return;
+    }
+    
+    if (worker_submit(&ij->job) == 0) {
+        ij->next = image_jobs;
+        image_jobs = ij;
+        return;
+    }
+    
+    if (deferred_job) {
+        printf("Dropping stale image: %s\n", deferred_job->path);
+        free(deferred_job);
+    }
+    printf("Image workers busy, deferring %s\n", ij->path);
+    deferred_job = ij;
+}
+
+// Called once workers have finished, so the queue has room again
+static void submit_deferred_job(void) {
+    if (!deferred_job) return;
+    
+    image_job_t *ij = deferred_job;
+    deferred_job = NULL;
+    if (ij->generation != scene_generation) {
+        printf("Dropping stale image: %s\n", ij->path);
+        free(ij);
+        return;
+    }
+    if (worker_submit(&ij->job) < 0) {
+        deferred_job = ij;
+        return;
+    }
+    ij->next = image_jobs;
+    image_jobs = ij;
+}
+
+static image_job_t *find_image_job(const image_key_t *key) {
+    for (image_job_t *ij = image_jobs; ij; ij = ij->next) {
+        if (ij->cacheable && !ij->animated && image_key_equal(&ij->key, key)) {
+            return ij;
+        }
+    }
+    return NULL;
+}
+
+static void show_image(const char *path, bool scaled, dither_mode_t dither) {
+    // Pre-rendered images need no decode, scaling or caching
+    int native = image_show_native(path);
+    if (native <= 0) {
+        if (native == 0) {
+            scene_pending = false;
+            frame_pending = true;
+        }
+        return;
+    }
+    
+    image_key_t key;
+    bool cacheable = image_key_init(&key, path, scaled, dither) == 0;
+    
+    // A cache hit, such as a finished preload, is already rendered
+    if (cacheable && image_cache_draw(&key)) {
+        scene_pending = false;
+        frame_pending = true;
+        return;
+    }
+    
+    // Still decoding, e.g. preloaded moments ago: show it once it is done
+    image_job_t *ij = cacheable ? find_image_job(&key) : NULL;
+    if (ij) {
+        ij->show = true;
+        ij->generation = scene_generation;
+        return;
+    }
+    
+    ij = new_image_job(path, scaled, dither);
+    if (!ij) {
+        printf("Failed to load image: %s\n", path);
+        return;
+    }
+    ij->key = key;
+    ij->cacheable = cacheable;
+    queue_show_job(ij);
+}
+
+// Animations are decoded on the worker like stills, but their rendered
+// frames are not cached: they are kept only while the animation plays.
+static void show_animation(const char *path, bool scaled, dither_mode_t dither, int loops) {
+    // Delta-encoded animations play straight from the file
+    int native = image_load_native_animation(path, &animation);
+    if (native <= 0) {
+        if (native == 0) {
+            play_animation(loops);
+        }
+        return;
+    }
+    
+    // Pre-rendered stills play as one frame, like any other still
+    native = image_show_native(path);
+    if (native <= 0) {
+        if (native == 0) {
+            scene_pending = false;
+            frame_pending = true;
+        }
+        return;
+    }
+    
+    image_job_t *ij = new_image_job(path, scaled, dither);
+    if (!ij) {
+        printf("Failed to load animation: %s\n", path);
+        return;
+    }
+    ij->animated = true;
+    ij->loops = loops;
+    queue_show_job(ij);
+}
+
+// Decodes and renders an image into the image cache ahead of time, so a
+// later show of the same file and options is a cache hit
+static void preload_image(const char *path, bool scaled, dither_mode_t dither) {
+    image_key_t key;
+    if (image_key_init(&key, path, scaled, dither) < 0) {
+        printf("Failed to load image: %s\n", path);
+        return;
+    }
+    if (image_cache_contains(&key) || find_image_job(&key)) {
+        return;
+    }
+    
+    image_job_t *ij = new_image_job(path, scaled, dither);
+    if (!ij) return;
+    
+    ij->show = false;
+    ij->key = key;
+    ij->cacheable = true;
+    if (submit_image_job(ij) < 0) {
+        printf("Image workers busy, not preloading %s\n", path);
+    }
+}
+
+static void draw_scene(const ssdsplash_message_t *msg) {
+    display_clear();
+    
     switch (msg->type) {
         case MSG_TYPE_TEXT:
-            display_clear();
-            
             if (strlen(msg->data.text_msg.font_path) > 0) {
-                printf("Text: %s (line %d, font: %s, size: %d)\n", 
-                       msg->data.text_msg.text, msg->data.text_msg.line,
-                       msg->data.text_msg.font_path, msg->data.text_msg.font_size);
                 display_draw_text_truetype(msg->data.text_msg.text, 0, msg->data.text_msg.line * msg->data.text_msg.font_size,
                                          msg->data.text_msg.font_path, msg->data.text_msg.font_size);
             } else {
-                printf("Text: %s (line %d, bitmap font)\n", msg->data.text_msg.text, msg->data.text_msg.line);
                 display_draw_text(msg->data.text_msg.text, 0, msg->data.text_msg.line * 8);
             }
-            
-            display_update();
             break;
-            
+        
         case MSG_TYPE_PROGRESS:
-            display_clear();
             display_draw_text("Loading...", 0, 0);
             display_draw_progress_bar(msg->data.progress_msg.value, 
                                     msg->data.progress_msg.max_value, 
                                     0, 16, 128, 8);
             
-            char progress_text[32];
-            snprintf(progress_text, sizeof(progress_text), "%d%%", 
-                    (msg->data.progress_msg.value * 100) / msg->data.progress_msg.max_value);
-            display_draw_text(progress_text, 90, 26);
-            display_update();
+            if (msg->data.progress_msg.max_value > 0) {
+                char progress_text[32];
+                snprintf(progress_text, sizeof(progress_text), "%d%%", 
+                        (msg->data.progress_msg.value * 100) / msg->data.progress_msg.max_value);
+                display_draw_text(progress_text, 90, 26);
+            }
+            break;
+        
+        default:
+            break;
+    }
+}
+
+// Messages only update the scene; the frame is drawn and flushed from the
+// main loop at most once per frame interval, so a burst of updates costs
+// a single bus transfer.
+static void set_scene(const ssdsplash_message_t *msg) {
+    pending_scene = *msg;
+    scene_pending = true;
+}
+
+static void handle_message(const ssdsplash_message_t *msg) {
+    if ((msg->type >= MSG_TYPE_TEXT && msg->type <= MSG_TYPE_IMAGE && msg->type != MSG_TYPE_QUIT) ||
+        msg->type == MSG_TYPE_COMMIT || msg->type == MSG_TYPE_ANIMATION) {
+        scene_generation++;
+        stop_animation();
+    }
+    
+    switch (msg->type) {
+        case MSG_TYPE_TEXT:
+            if (strlen(msg->data.text_msg.font_path) > 0) {
+                printf("Text: %s (line %d, font: %s, size: %d)\n", 
+                       msg->data.text_msg.text, msg->data.text_msg.line,
+                       msg->data.text_msg.font_path, msg->data.text_msg.font_size);
+            } else {
+                printf("Text: %s (line %d, bitmap font)\n", msg->data.text_msg.text, msg->data.text_msg.line);
+            }
+            set_scene(msg);
+            break;
+        
+        case MSG_TYPE_PROGRESS:
             printf("Progress: %d/%d\n", msg->data.progress_msg.value, msg->data.progress_msg.max_value);
+            set_scene(msg);
             break;
-            
+        
         case MSG_TYPE_CLEAR:
-            display_clear();
-            display_update();
             printf("Screen cleared\n");
+            set_scene(msg);
             break;
-            
+        
         case MSG_TYPE_QUIT:
             printf("Quit requested\n");
             running = false;
             break;
-            
+        
         case MSG_TYPE_IMAGE:
             printf("Loading image: %s (scaled: %s)\n", 
                    msg->data.image_msg.path, 
                    msg->data.image_msg.scaled ? "yes" : "no");
             
-            if (msg->data.image_msg.scaled) {
-                if (display_load_and_display_image_scaled(msg->data.image_msg.path) < 0) {
-                    printf("Failed to load image: %s\n", msg->data.image_msg.path);
-                }
+            show_image(msg->data.image_msg.path, msg->data.image_msg.scaled, msg->data.image_msg.dither);
+            break;
+        
+        case MSG_TYPE_PRELOAD:
+            printf("Preloading image: %s (scaled: %s)\n",
+                   msg->data.image_msg.path,
+                   msg->data.image_msg.scaled ? "yes" : "no");
+            
+            preload_image(msg->data.image_msg.path, msg->data.image_msg.scaled, msg->data.image_msg.dither);
+            break;
+        
+        case MSG_TYPE_ANIMATION:
+            printf("Loading animation: %s (scaled: %s, loops: %d)\n",
+                   msg->data.image_msg.path,
+                   msg->data.image_msg.scaled ? "yes" : "no",
+                   msg->data.image_msg.loops);
+            
+            show_animation(msg->data.image_msg.path, msg->data.image_msg.scaled, msg->data.image_msg.dither,
+                           msg->data.image_msg.loops);
+            break;
+        
+        case MSG_TYPE_COMMIT: {
+            // The client drew straight into the shared framebuffer, which
+            // supersedes any scene not yet drawn
+            int width = msg->data.commit_msg.width;
+            int height = msg->data.commit_msg.height;
+            display_mark_dirty(msg->data.commit_msg.x, msg->data.commit_msg.y,
+                               width > 0 ? width : current_config.width,
+                               height > 0 ? height : current_config.height);
+            scene_pending = false;
+            frame_pending = true;
+            break;
+        }
+        
+        case MSG_TYPE_MAP_FRAMEBUFFER:
+            printf("Framebuffer requests need a stream connection\n");
+            break;
+        
+        default:
+            printf("Ignoring unknown message type %d\n", msg->type);
+            break;
+    }
+}
+
+// Replies to MSG_TYPE_MAP_FRAMEBUFFER with the framebuffer layout and the
+// memfd passed as SCM_RIGHTS.
+static void send_framebuffer(int fd) {
+    display_shared_fb_t shared;
+    if (display_share_framebuffer(&shared) < 0) {
+        fprintf(stderr, "Framebuffer sharing unavailable\n");
+        return;
+    }
+    
+    ssdsplash_message_t reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.type = MSG_TYPE_MAP_FRAMEBUFFER;
+    reply.data.framebuffer_msg.width = current_config.width;
+    reply.data.framebuffer_msg.height = current_config.height;
+    reply.data.framebuffer_msg.format = current_config.format;
+    reply.data.framebuffer_msg.stride = shared.stride;
+    reply.data.framebuffer_msg.offset = shared.offset;
+    reply.data.framebuffer_msg.size = shared.size;
+    
+    uint8_t frame[SSDSPLASH_MAX_FRAME];
+    int len = protocol_encode(&reply, frame, sizeof(frame));
+    if (len < 0) return;
+    
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = frame, .iov_len = len };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &shared.fd, sizeof(int));
+    
+    if (sendmsg(fd, &mh, MSG_NOSIGNAL) != len) {
+        perror("sendmsg");
+        return;
+    }
+    printf("Shared framebuffer with client\n");
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Milliseconds until the next frame may be flushed, for epoll_wait()
+static int frame_timeout_ms(void) {
+    if (!scene_pending && !frame_pending) return 1000;
+    
+    uint64_t due = last_frame_us + frame_interval_us;
+    uint64_t now = now_us();
+    if (now >= due) return 0;
+    return (due - now + 999) / 1000;
+}
+
+static void render_frame(void) {
+    if (!scene_pending && !frame_pending) return;
+    
+    uint64_t now = now_us();
+    if (now < last_frame_us + frame_interval_us) return;
+    
+    if (scene_pending) {
+        draw_scene(&pending_scene);
+        scene_pending = false;
+    }
+    display_update();
+    frame_pending = false;
+    last_frame_us = now;
+}
+
+static void close_client(client_t *client) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    free(client);
+    client_count--;
+}
+
+static void accept_clients(void) {
+    for (;;) {
+        int client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EINTR) perror("accept");
+            return;
+        }
+        
+        client_t *client = client_count < MAX_CLIENTS ? calloc(1, sizeof(*client)) : NULL;
+        if (!client) {
+            fprintf(stderr, "Too many clients, dropping connection\n");
+            close(client_fd);
+            continue;
+        }
+        
+        client->fd = client_fd;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = client };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(client_fd);
+            free(client);
+            continue;
+        }
+        client_count++;
+    }
+}
+
+// Connections may carry any number of messages back to back, framed or
+// legacy; a client streaming updates keeps its connection open until it
+// is done.
+static void read_client(client_t *client) {
+    for (int i = 0; i < MAX_READS_PER_WAKEUP; i++) {
+        ssize_t n = read(client->fd, client->buf + client->received, sizeof(client->buf) - client->received);
+        
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            close_client(client);
+            return;
+        }
+        client->received += n;
+        
+        size_t offset = 0;
+        for (;;) {
+            ssdsplash_message_t msg;
+            size_t consumed;
+            int ret = protocol_decode(client->buf + offset, client->received - offset, &msg, &consumed);
+            
+            if (ret < 0) {
+                fprintf(stderr, "Malformed message, closing connection\n");
+                close_client(client);
+                return;
+            }
+            if (ret == 0) break;
+            
+            if (msg.type == MSG_TYPE_MAP_FRAMEBUFFER) {
+                send_framebuffer(client->fd);
             } else {
-                if (display_load_and_display_image(msg->data.image_msg.path) < 0) {
-                    printf("Failed to load image: %s\n", msg->data.image_msg.path);
-                }
+                handle_message(&msg);
             }
-            break;
+            offset += consumed;
+        }
+        
+        client->received -= offset;
+        memmove(client->buf, client->buf + offset, client->received);
     }
 }
 
-static void* client_handler(void* arg) {
-    int client_fd = *(int*)arg;
-    free(arg);
+static void read_datagrams(void) {
+    uint8_t buf[SSDSPLASH_MAX_FRAME];
     
-    ssdsplash_message_t msg;
-    ssize_t bytes_read = recv(client_fd, &msg, sizeof(msg), 0);
+    for (int i = 0; i < MAX_READS_PER_WAKEUP; i++) {
+        ssize_t n = recv(dgram_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) perror("recv");
+            return;
+        }
+        
+        ssdsplash_message_t msg;
+        size_t consumed;
+        if (protocol_decode(buf, n, &msg, &consumed) > 0) {
+            handle_message(&msg);
+        } else {
+            fprintf(stderr, "Dropping malformed datagram\n");
+        }
+    }
+}
+
+static int setup_event_loop(void) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
     
-    if (bytes_read == sizeof(msg)) {
-        handle_message(&msg);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &server_fd };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
     }
     
-    close(client_fd);
-    return NULL;
+    if (dgram_fd >= 0) {
+        ev.data.ptr = &dgram_fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dgram_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+    
+    // Without the worker or timer the daemon still runs: images decode
+    // inline and animations stay on their first frame
+    worker_fd = worker_init();
+    if (worker_fd >= 0) {
+        ev.data.ptr = &worker_fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            worker_shutdown();
+            worker_fd = -1;
+        }
+    }
+    if (worker_fd < 0) {
+        fprintf(stderr, "Image worker unavailable, decoding inline\n");
+    }
+    
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        perror("timerfd_create");
+    } else {
+        ev.data.ptr = &timer_fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(timer_fd);
+            timer_fd = -1;
+        }
+    }
+    if (timer_fd < 0) {
+        fprintf(stderr, "Animations will show their first frame only\n");
+    }
+    
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -162,11 +846,18 @@ int main(int argc, char *argv[]) {
         {"device", required_argument, 0, 'd'},
         {"address", required_argument, 0, 'a'},
         {"type", required_argument, 0, 't'},
+        {"spi-speed", required_argument, 0, 'S'},
+        {"gpiochip", required_argument, 0, 'g'},
+        {"dc-gpio", required_argument, 0, 'c'},
+        {"reset-gpio", required_argument, 0, 'r'},
+        {"max-fps", required_argument, 0, 'F'},
+        {"font-budget", required_argument, 0, 'B'},
+        {"image-cache", required_argument, 0, 'I'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
     
-    while ((opt = getopt_long(argc, argv, "d:a:t:h", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:a:t:S:g:c:r:F:B:I:h", long_options, NULL)) != -1) {
         switch (opt) {
             case 'd':
                 device_path = strdup(optarg);
@@ -200,6 +891,49 @@ int main(int argc, char *argv[]) {
                     return 1;
                 }
                 break;
+            case 'S':
+                spi_config.speed_hz = strtoul(optarg, NULL, 0);
+                if (spi_config.speed_hz == 0) {
+                    fprintf(stderr, "Invalid SPI speed: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'g':
+                spi_config.gpiochip = optarg;
+                break;
+            case 'c':
+                spi_config.dc_line = atoi(optarg);
+                break;
+            case 'r':
+                spi_config.reset_line = atoi(optarg);
+                break;
+            case 'F': {
+                int fps = atoi(optarg);
+                if (fps <= 0) {
+                    fprintf(stderr, "Invalid refresh rate: %s\n", optarg);
+                    return 1;
+                }
+                frame_interval_us = 1000000 / fps;
+                break;
+            }
+            case 'B': {
+                long kb = atol(optarg);
+                if (kb <= 0) {
+                    fprintf(stderr, "Invalid font budget: %s\n", optarg);
+                    return 1;
+                }
+                display_set_font_budget((size_t)kb * 1024);
+                break;
+            }
+            case 'I': {
+                long kb = atol(optarg);
+                if (kb < 0) {
+                    fprintf(stderr, "Invalid image cache size: %s\n", optarg);
+                    return 1;
+                }
+                image_set_cache_budget((size_t)kb * 1024);
+                break;
+            }
             case 'h':
                 show_help(argv[0]);
                 return 0;
@@ -212,6 +946,8 @@ int main(int argc, char *argv[]) {
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
+    display_set_spi_config(&spi_config);
+    
     if (display_init(display_type, device_path, device_address) < 0) {
         fprintf(stderr, "Failed to initialize display\n");
         return 1;
@@ -233,56 +969,67 @@ int main(int argc, char *argv[]) {
     display_draw_text("display ready", 0, 0);
     display_update();
     
-    if (setup_server_socket() < 0) {
+    if (setup_server_socket() < 0 || setup_event_loop() < 0) {
         display_cleanup();
         return 1;
     }
     
     while (running) {
-        fd_set read_fds;
-        struct timeval timeout;
-        
-        FD_ZERO(&read_fds);
-        FD_SET(server_fd, &read_fds);
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, frame_timeout_ms());
         
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int activity = select(server_fd + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if (activity < 0 && errno != EINTR) {
-            perror("select");
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
             break;
         }
         
-        if (activity > 0 && FD_ISSET(server_fd, &read_fds)) {
-            int client_fd = accept(server_fd, NULL, NULL);
-            if (client_fd >= 0) {
-                int *client_fd_ptr = malloc(sizeof(int));
-                *client_fd_ptr = client_fd;
-                
-                pthread_t thread;
-                if (pthread_create(&thread, NULL, client_handler, client_fd_ptr) == 0) {
-                    pthread_detach(thread);
-                } else {
-                    close(client_fd);
-                    free(client_fd_ptr);
-                }
+        for (int i = 0; i < count && running; i++) {
+            if (events[i].data.ptr == &server_fd) {
+                accept_clients();
+            } else if (events[i].data.ptr == &dgram_fd) {
+                read_datagrams();
+            } else if (events[i].data.ptr == &worker_fd) {
+                worker_complete();
+                submit_deferred_job();
+            } else if (events[i].data.ptr == &timer_fd) {
+                advance_animation();
+            } else {
+                read_client(events[i].data.ptr);
             }
         }
+        
+        render_frame();
     }
     
     printf("Shutting down...\n");
+    worker_shutdown();
+    free(deferred_job);
+    stop_animation();
     display_clear();
     display_update();
     display_cleanup();
     display_cleanup_truetype();
+    image_cache_cleanup();
     
     if (server_fd >= 0) {
         close(server_fd);
         unlink(SSDSPLASH_SOCKET_PATH);
     }
     
+    if (dgram_fd >= 0) {
+        close(dgram_fd);
+        unlink(SSDSPLASH_DGRAM_SOCKET_PATH);
+    }
+    
+    if (timer_fd >= 0) {
+        close(timer_fd);
+    }
+    
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    
     if (device_path) {
         free(device_path);
     }
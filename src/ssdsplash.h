@@ -3,9 +3,11 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #define SSDSPLASH_SOCKET_PATH "/tmp/ssdsplash.sock"
-#define SSDSPLASH_MAX_TEXT_LEN 128
+#define SSDSPLASH_DGRAM_SOCKET_PATH "/tmp/ssdsplash.dgram"
+#define SSDSPLASH_MAX_TEXT_LEN 1024
 #define SSDSPLASH_MAX_PATH_LEN 256
 
 typedef enum {
@@ -13,9 +15,14 @@ typedef enum {
     MSG_TYPE_PROGRESS = 2,
     MSG_TYPE_CLEAR = 3,
     MSG_TYPE_QUIT = 4,
-    MSG_TYPE_IMAGE = 5
+    MSG_TYPE_IMAGE = 5,
+    MSG_TYPE_MAP_FRAMEBUFFER = 6,
+    MSG_TYPE_COMMIT = 7,
+    MSG_TYPE_ANIMATION = 8,
+    MSG_TYPE_PRELOAD = 9        // image_msg: prepare an image without showing it
 } message_type_t;
 
+// Decoded message as handled by the daemon
 typedef struct {
     message_type_t type;
     union {
@@ -32,10 +39,99 @@ typedef struct {
         struct {
             char path[SSDSPLASH_MAX_PATH_LEN];
             bool scaled;
+            int dither;         // dither_mode_t
+            int loops;          // animations: times to play, 0 repeats forever
         } image_msg;
+        struct {
+            int width;
+            int height;
+            int format;         // pixel_format_t
+            int stride;
+            int offset;
+            int size;
+        } framebuffer_msg;
+        struct {
+            int x;
+            int y;
+            int width;          // 0 extends to the right edge
+            int height;         // 0 extends to the bottom edge
+        } commit_msg;
     } data;
 } ssdsplash_message_t;
 
+// Wire protocol
+//
+// Every message is a 6-byte header followed by a payload of TLV fields:
+//   header: 'S' 'S' version:u8 type:u8 length:u16le
+//   field:  tag:u8 length:u16le value[length]
+// Integers are little-endian int32, strings are not NUL-terminated. Readers
+// skip unknown tags, so fields can be added without bumping the version.
+//
+// Shared framebuffer: a client sends MSG_TYPE_MAP_FRAMEBUFFER over the
+// stream socket and the daemon answers with a MSG_TYPE_MAP_FRAMEBUFFER
+// message describing the layout, with the framebuffer memfd attached as
+// SCM_RIGHTS ancillary data. Pixel (0, 0) is at offset; for
+// PIXEL_FORMAT_MONO stride is the distance between pages, for
+// PIXEL_FORMAT_RGB565 between rows. After drawing, the client sends
+// MSG_TYPE_COMMIT with the changed region and the daemon flushes it on the
+// next frame.
+//
+// Clients predating the framed protocol send a raw fixed-size
+// ssdsplash_legacy_message_t; the daemon tells the two apart by the magic.
+#define SSDSPLASH_PROTO_MAGIC0 'S'
+#define SSDSPLASH_PROTO_MAGIC1 'S'
+#define SSDSPLASH_PROTO_VERSION 1
+#define SSDSPLASH_HEADER_LEN 6
+#define SSDSPLASH_MAX_PAYLOAD 4096
+#define SSDSPLASH_MAX_FRAME (SSDSPLASH_HEADER_LEN + SSDSPLASH_MAX_PAYLOAD)
+
+typedef enum {
+    FIELD_TEXT = 1,
+    FIELD_LINE = 2,
+    FIELD_FONT_PATH = 3,
+    FIELD_FONT_SIZE = 4,
+    FIELD_VALUE = 5,
+    FIELD_MAX_VALUE = 6,
+    FIELD_PATH = 7,
+    FIELD_SCALED = 8,
+    FIELD_X = 9,
+    FIELD_Y = 10,
+    FIELD_WIDTH = 11,
+    FIELD_HEIGHT = 12,
+    FIELD_FORMAT = 13,
+    FIELD_STRIDE = 14,
+    FIELD_OFFSET = 15,
+    FIELD_SIZE = 16,
+    FIELD_DITHER = 17,
+    FIELD_LOOPS = 18
+} message_field_t;
+
+#define SSDSPLASH_LEGACY_TEXT_LEN 128
+
+typedef struct {
+    message_type_t type;
+    union {
+        struct {
+            char text[SSDSPLASH_LEGACY_TEXT_LEN];
+            int line;
+            char font_path[SSDSPLASH_MAX_PATH_LEN];
+            int font_size;
+        } text_msg;
+        struct {
+            int value;
+            int max_value;
+        } progress_msg;
+        struct {
+            char path[SSDSPLASH_MAX_PATH_LEN];
+            bool scaled;
+        } image_msg;
+    } data;
+} ssdsplash_legacy_message_t;
+
+int protocol_encode(const ssdsplash_message_t *msg, uint8_t *buf, size_t size);
+int protocol_decode(const uint8_t *buf, size_t len, ssdsplash_message_t *msg, size_t *consumed);
+void protocol_from_legacy(const ssdsplash_legacy_message_t *legacy, ssdsplash_message_t *msg);
+
 typedef enum {
     DISPLAY_128x64 = 0,
     DISPLAY_128x32 = 1,
@@ -43,24 +139,262 @@ typedef enum {
     DISPLAY_SSH1106_128x64 = 3
 } display_type_t;
 
+typedef enum {
+    PIXEL_FORMAT_MONO = 0,      // 1bpp, 8 vertical pixels per byte, page-packed
+    PIXEL_FORMAT_RGB565 = 1     // 16bpp big-endian, row-major
+} pixel_format_t;
+
 typedef struct {
     int width;
     int height;
-    int pages;
+    int pages;                  // 8-row bands used for dirty tracking
+    pixel_format_t format;
 } display_config_t;
 
 extern const display_config_t display_configs[];
 
+#define SPI_SPEED_DEFAULT 32000000
+#define SPI_GPIOCHIP_DEFAULT "/dev/gpiochip0"
+#define SPI_DC_LINE_DEFAULT 24
+#define SPI_RESET_LINE_DEFAULT 25
+
+typedef struct {
+    uint32_t speed_hz;
+    const char *gpiochip;
+    int dc_line;
+    int reset_line;     // -1 if RESET is not wired
+} spi_config_t;
+
+int spi_open(const char *device, const spi_config_t *cfg);
+void spi_close(void);
+void spi_reset(void);
+int spi_command(uint8_t cmd, const uint8_t *params, size_t len);
+int spi_data(const uint8_t *data, size_t len);
+size_t spi_max_transfer(void);
+
+void display_set_spi_config(const spi_config_t *cfg);
 int display_init(display_type_t type, const char *device, uint8_t addr);
+int display_init_offscreen(display_type_t type);
 void display_cleanup(void);
 void display_clear(void);
 void display_update(void);
+void display_mark_dirty(int x, int y, int width, int height);
+size_t display_snapshot_size(void);
+void display_save_snapshot(uint8_t *buf);
+void display_restore_snapshot(const uint8_t *buf);
+int display_begin_offscreen(void);
+void display_end_offscreen(void);
+void display_write_span(int page, int x, const uint8_t *data, int len);
+int display_flush_spans(void);
+
+typedef struct {
+    int fd;             // owned by the display, valid until display_cleanup()
+    size_t size;
+    size_t offset;
+    size_t stride;
+} display_shared_fb_t;
+
+int display_share_framebuffer(display_shared_fb_t *shared);
+void display_draw_pixel(int x, int y, bool on);
+void display_blit_columns(const uint8_t *columns, int count, int x, int y);
+void display_put_row_rgb565(int x, int y, const uint8_t *pixels, int count);
+void display_fill_rect(int x, int y, int width, int height, bool on);
+void display_draw_hline(int x, int y, int width, bool on);
+void display_draw_vline(int x, int y, int height, bool on);
 void display_draw_text(const char *text, int x, int y);
 void display_draw_progress_bar(int value, int max_value, int x, int y, int width, int height);
 
-int display_load_and_display_image(const char *filename);
-int display_load_and_display_image_scaled(const char *filename);
+typedef struct {
+    unsigned char *pixels;      // all frames, one after the other
+    int width;
+    int height;
+    int channels;
+    int frames;
+    int *delays;                // per-frame delays in ms, NULL for stills
+} decoded_image_t;
+
+// How images are reduced to 1bpp on monochrome panels
+typedef enum {
+    DITHER_BAYER = 0,           // 4x4 ordered dither, cheapest
+    DITHER_FLOYD_STEINBERG = 1, // error diffusion into the next row
+    DITHER_ATKINSON = 2         // error diffusion over two rows, keeps 3/4 of the error
+} dither_mode_t;
+
+int image_decode(const char *filename, decoded_image_t *img);
+int image_decode_animation(const char *filename, decoded_image_t *img);
+void image_render(const decoded_image_t *img, bool scaled, dither_mode_t dither);
+void image_release(decoded_image_t *img);
+
+// Animation pre-rendered into one display snapshot per frame, so playing
+// it is a snapshot restore per frame, or a mapped .ssda file whose frames
+// are sent to the panel as deltas. Frames must be shown in order.
+typedef struct {
+    uint8_t *frames;
+    int *delays;                // ms
+    int frame_count;
+    size_t frame_size;
+    const uint8_t *map;         // .ssda file, NULL for rendered frames
+    size_t map_size;
+    int current;                // frame on screen, -1 before the first
+} image_animation_t;
+
+// Frame delays below the minimum are played at the default instead
+#define ANIMATION_MIN_DELAY_MS 20
+#define ANIMATION_DEFAULT_DELAY_MS 100
+
+int image_render_animation(const decoded_image_t *img, bool scaled, dither_mode_t dither, image_animation_t *anim);
+void image_animation_show(image_animation_t *anim, int frame);
+void image_animation_release(image_animation_t *anim);
+
+// Rendered images are cached as framebuffer snapshots, least recently used
+// first out, while their total size fits the budget. Entries are keyed by
+// the file's identity and modification time, the render options and the
+// framebuffer layout, so an edited file or a different mode renders anew.
+#define IMAGE_CACHE_ENTRIES 16
+#define IMAGE_CACHE_BUDGET_DEFAULT (512 * 1024)
+
+typedef struct {
+    char path[SSDSPLASH_MAX_PATH_LEN];
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    bool scaled;
+    dither_mode_t dither;
+    int width;                  // framebuffer layout the snapshot is for
+    int height;
+    pixel_format_t format;
+} image_key_t;
+
+// Pre-rendered splash image, written by ssdsplash-convert for one panel
+// layout and copied into the framebuffer as is. Stored in host byte order.
+// The pixel data is a display snapshot: for PIXEL_FORMAT_MONO one row of
+// width column bytes (bit 0 on top) per 8-row page, for PIXEL_FORMAT_RGB565
+// big-endian pixels row by row.
+#define SPLASH_IMAGE_MAGIC "SSDI"
+#define SPLASH_IMAGE_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t format;            // pixel_format_t
+    uint16_t width;
+    uint16_t height;
+    uint32_t data_offset;       // from the start of the file
+    uint32_t data_size;
+} splash_image_header_t;
+
+int image_show_native(const char *path);
+
+// Pre-rendered animation for monochrome panels, written by ssdsplash-convert
+// and played straight from a read-only mapping. Entry 0 of the frame index
+// redraws the whole screen, entries 1..frame_count-1 change frame i-1 into
+// frame i, and entry frame_count changes the last frame back into frame 0.
+// Each entry is a run of spans within one page: a splash_span_t, then len
+// column bytes. The span's control byte is the I2C data control byte, so
+// the span goes out as one bus segment without copying.
+#define SPLASH_ANIMATION_MAGIC "SSDA"
+#define SPLASH_ANIMATION_VERSION 1
+#define SPLASH_SPAN_CONTROL 0x40
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t format;            // PIXEL_FORMAT_MONO
+    uint16_t width;
+    uint16_t height;
+    uint16_t frame_count;
+    uint16_t reserved;
+    uint32_t index_offset;      // frame_count + 1 splash_frame_t
+} splash_animation_header_t;
+
+typedef struct {
+    uint32_t offset;            // spans, from the start of the file
+    uint32_t size;
+    uint16_t span_count;
+    uint16_t delay;             // ms to show the frame for
+} splash_frame_t;
+
+typedef struct {
+    uint8_t page;
+    uint8_t x;
+    uint8_t len;
+    uint8_t control;            // SPLASH_SPAN_CONTROL
+} splash_span_t;
+
+int image_load_native_animation(const char *path, image_animation_t *anim);
+
+int image_key_init(image_key_t *key, const char *path, bool scaled, dither_mode_t dither);
+bool image_key_equal(const image_key_t *a, const image_key_t *b);
+bool image_cache_draw(const image_key_t *key);
+bool image_cache_contains(const image_key_t *key);
+bool image_cache_store(const image_key_t *key);
+void image_set_cache_budget(size_t bytes);
+size_t image_get_cache_budget(void);
+void image_cache_cleanup(void);
+
+// Background workers for slow jobs such as image decoding. run() executes
+// on one of a small pool of threads, so jobs can finish out of order;
+// done() runs on the main loop from worker_complete()
+// once the worker's eventfd becomes readable. At shutdown, unfinished jobs
+// are passed to done() with cancelled set.
+typedef struct worker_job {
+    void (*run)(struct worker_job *job);
+    void (*done)(struct worker_job *job);
+    bool cancelled;
+    struct worker_job *next;
+} worker_job_t;
+
+int worker_init(void);
+int worker_submit(worker_job_t *job);
+void worker_complete(void);
+void worker_shutdown(void);
+
+// Pre-rasterized font atlas, written at build time by ssdsplash-fontgen
+// and mapped by the daemon in place of a .ttf. Structures are stored in
+// host byte order (little-endian on every supported target). Glyph bitmaps
+// are 8-row bands of column bytes, bit 0 on top, like the panel's pages.
+#define FONT_ATLAS_MAGIC "SSDF"
+#define FONT_ATLAS_VERSION 2
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t size_count;        // font_atlas_size_t entries follow
+} font_atlas_header_t;
+
+typedef struct {
+    uint16_t pixel_size;
+    int16_t ascent;
+    uint32_t glyph_count;
+    uint32_t glyph_offset;      // file offset of the glyphs, sorted by codepoint
+    uint32_t kern_count;
+    uint32_t kern_offset;       // file offset of the kerning pairs, sorted by (left, right)
+} font_atlas_size_t;
+
+typedef struct {
+    uint32_t codepoint;
+    uint32_t bits_offset;       // file offset of the bitmap
+    uint16_t width;
+    uint16_t height;
+    int16_t xoff;
+    int16_t yoff;
+    int16_t advance;
+    uint16_t reserved;
+} font_atlas_glyph_t;
+
+typedef struct {
+    uint32_t left;              // codepoints
+    uint32_t right;
+    int16_t adjust;             // pixels added to the advance between them
+    uint16_t reserved;
+} font_atlas_kern_t;
+
+// Loaded font files are kept mapped, least recently used first out,
+// while their total size fits the budget
+#define FONT_CACHE_BUDGET_DEFAULT (4 * 1024 * 1024)
 
+void display_set_font_budget(size_t bytes);
 void display_draw_text_truetype(const char *text, int x, int y, const char *font_path, int font_size);
 void display_cleanup_truetype(void);
 
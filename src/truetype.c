@@ -1,86 +1,606 @@
+#define _GNU_SOURCE
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "stb_truetype.h"
 #include "ssdsplash.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-extern void display_draw_pixel(int x, int y, bool on);
 extern display_config_t current_config;
 
+#define FONT_CACHE_FACES 8
+#define GLYPH_CACHE_ENTRIES 128
+#define GLYPH_CACHE_BUCKETS 64
+#define GLYPH_SLOT_BYTES 256
+#define LAYOUT_CACHE_RUNS 16
+
+// Loaded font file, shared by every size it is drawn at. The file is
+// mapped read-only rather than copied onto the heap. It is either a
+// TrueType font or a pre-rasterized atlas from ssdsplash-fontgen.
 typedef struct {
     char path[SSDSPLASH_MAX_PATH_LEN];
-    int size;
+    unsigned id;                // distinguishes faces in the glyph cache, never reused
     stbtt_fontinfo font;
-    unsigned char *font_data;
+    const font_atlas_header_t *atlas;   // NULL for TrueType
+    unsigned char *data;
+    size_t data_size;
+    unsigned long last_used;
+} font_face_t;
+
+// Face and size-dependent metrics for the current draw call
+typedef struct {
+    font_face_t *face;
+    int size;
+    const font_atlas_size_t *atlas_size;
     float scale;
     int ascent, descent, line_gap;
-} font_cache_t;
+} active_font_t;
+
+// One glyph of a laid-out string, positioned relative to the text origin
+typedef struct {
+    int glyph;                  // TrueType glyph index, or index into the atlas glyph table
+    int x;
+    int baseline;
+    int end;                    // pen position after the glyph
+} run_glyph_t;
+
+// A string decoded from UTF-8, resolved to glyphs and kerned once, so
+// drawing the same text again is only blits
+typedef struct {
+    unsigned face_id;
+    int size;
+    char *text;
+    run_glyph_t *glyphs;
+    int count;
+    unsigned long last_used;
+} text_run_t;
+
+static font_face_t faces[FONT_CACHE_FACES];
+static size_t faces_bytes = 0;
+static size_t font_budget = FONT_CACHE_BUDGET_DEFAULT;
+static unsigned long face_clock = 0;
+static unsigned next_face_id = 1;
+static active_font_t cached_font = {0};
+static text_run_t runs[LAYOUT_CACHE_RUNS];
+static unsigned long run_clock = 0;
 
-static font_cache_t cached_font = {0};
+// Rasterized glyph, thresholded and packed into 8-row bands of column
+// bytes like the panel's pages, so drawing it is one blit per band.
+// Entries live in a fixed arena, chained per hash bucket and kept in LRU
+// order; indices are -1 terminated.
+typedef struct {
+    unsigned face_id;
+    int size;
+    int glyph_index;
+    int16_t width, height;
+    int16_t xoff, yoff;
+    int16_t hash_next;
+    int16_t lru_prev, lru_next;
+    uint8_t bits[GLYPH_SLOT_BYTES];
+} glyph_t;
+
+static glyph_t glyph_cache[GLYPH_CACHE_ENTRIES];
+static int16_t glyph_buckets[GLYPH_CACHE_BUCKETS];
+static int glyph_count = -1;        // -1 until the buckets are initialized
+static int16_t lru_head = -1;       // most recently used
+static int16_t lru_tail = -1;
 
-static void free_cached_font(void) {
-    if (cached_font.font_data) {
-        free(cached_font.font_data);
-        cached_font.font_data = NULL;
-        memset(&cached_font, 0, sizeof(cached_font));
+void display_set_font_budget(size_t bytes) {
+    font_budget = bytes;
+}
+
+static void unload_face(font_face_t *face) {
+    if (cached_font.face == face) {
+        cached_font.face = NULL;
+    }
+    if (face->data) {
+        munmap(face->data, face->data_size);
+        faces_bytes -= face->data_size;
     }
+    memset(face, 0, sizeof(*face));
 }
 
-static int load_truetype_font(const char *font_path, int font_size) {
-    if (cached_font.font_data && 
-        strcmp(cached_font.path, font_path) == 0 && 
-        cached_font.size == font_size) {
-        return 0;
+// Unmaps least recently used faces until needed more bytes fit the budget,
+// and returns a free slot. A single font larger than the budget is still
+// loaded, alone.
+static font_face_t *make_room(size_t needed) {
+    for (;;) {
+        font_face_t *free_slot = NULL;
+        font_face_t *oldest = NULL;
+        for (int i = 0; i < FONT_CACHE_FACES; i++) {
+            if (!faces[i].data) {
+                if (!free_slot) free_slot = &faces[i];
+            } else if (!oldest || faces[i].last_used < oldest->last_used) {
+                oldest = &faces[i];
+            }
+        }
+        
+        if (free_slot && (faces_bytes + needed <= font_budget || !oldest)) {
+            return free_slot;
+        }
+        
+        printf("Evicting font: %s\n", oldest->path);
+        unload_face(oldest);
+    }
+}
+
+static const font_atlas_size_t *atlas_sizes(const font_atlas_header_t *atlas) {
+    return (const font_atlas_size_t *)(atlas + 1);
+}
+
+static const font_atlas_glyph_t *atlas_glyphs(const font_face_t *face, const font_atlas_size_t *size) {
+    return (const font_atlas_glyph_t *)(face->data + size->glyph_offset);
+}
+
+// Checks that every table and bitmap of an atlas lies inside the file, so
+// drawing from it needs no bounds checks.
+static bool atlas_valid(const unsigned char *data, size_t data_size) {
+    const font_atlas_header_t *atlas = (const font_atlas_header_t *)data;
+    if (atlas->version != FONT_ATLAS_VERSION ||
+        sizeof(*atlas) + (uint64_t)atlas->size_count * sizeof(font_atlas_size_t) > data_size) {
+        return false;
     }
     
-    free_cached_font();
+    for (int s = 0; s < atlas->size_count; s++) {
+        const font_atlas_size_t *size = &atlas_sizes(atlas)[s];
+        if (size->glyph_offset % 4 != 0 ||
+            size->glyph_offset + (uint64_t)size->glyph_count * sizeof(font_atlas_glyph_t) > data_size) {
+            return false;
+        }
+        
+        if (size->kern_offset % 4 != 0 ||
+            size->kern_offset + (uint64_t)size->kern_count * sizeof(font_atlas_kern_t) > data_size) {
+            return false;
+        }
+        
+        const font_atlas_glyph_t *glyphs = (const font_atlas_glyph_t *)(data + size->glyph_offset);
+        for (uint32_t i = 0; i < size->glyph_count; i++) {
+            if (glyphs[i].bits_offset + (uint64_t)((glyphs[i].height + 7) / 8) * glyphs[i].width > data_size) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// stb_truetype trusts the file it is given. Check at least that this is a
+// single TrueType/OpenType font whose tables all lie inside the file.
+static bool truetype_valid(const uint8_t *data, size_t data_size) {
+    if (data_size < 12) return false;
     
-    FILE *font_file = fopen(font_path, "rb");
-    if (!font_file) {
-        printf("Failed to open font file: %s\n", font_path);
-        return -1;
+    uint32_t tag = read_be32(data);
+    if (tag != 0x00010000 && tag != 0x74727565 && tag != 0x4F54544F) {   // 1.0, "true", "OTTO"
+        return false;
     }
     
-    fseek(font_file, 0, SEEK_END);
-    long font_data_size = ftell(font_file);
-    fseek(font_file, 0, SEEK_SET);
+    int tables = data[4] << 8 | data[5];
+    if (12 + (uint64_t)tables * 16 > data_size) return false;
     
-    cached_font.font_data = malloc(font_data_size);
-    if (!cached_font.font_data) {
-        fclose(font_file);
-        return -1;
+    for (int i = 0; i < tables; i++) {
+        const uint8_t *entry = data + 12 + i * 16;
+        if ((uint64_t)read_be32(entry + 8) + read_be32(entry + 12) > data_size) {
+            return false;
+        }
     }
+    return true;
+}
+
+static const font_atlas_glyph_t *atlas_find_glyph(uint32_t codepoint) {
+    const font_atlas_glyph_t *glyphs = atlas_glyphs(cached_font.face, cached_font.atlas_size);
+    int lo = 0, hi = (int)cached_font.atlas_size->glyph_count - 1;
     
-    if (fread(cached_font.font_data, 1, font_data_size, font_file) != (size_t)font_data_size) {
-        fclose(font_file);
-        free(cached_font.font_data);
-        cached_font.font_data = NULL;
-        return -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (glyphs[mid].codepoint == codepoint) return &glyphs[mid];
+        if (glyphs[mid].codepoint < codepoint) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+static int atlas_kern(uint32_t left, uint32_t right) {
+    const font_atlas_kern_t *kerns = (const font_atlas_kern_t *)(cached_font.face->data + cached_font.atlas_size->kern_offset);
+    uint64_t key = ((uint64_t)left << 32) | right;
+    int lo = 0, hi = (int)cached_font.atlas_size->kern_count - 1;
+    
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        uint64_t mid_key = ((uint64_t)kerns[mid].left << 32) | kerns[mid].right;
+        if (mid_key == key) return kerns[mid].adjust;
+        if (mid_key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return 0;
+}
+
+static font_face_t *load_face(const char *font_path) {
+    for (int i = 0; i < FONT_CACHE_FACES; i++) {
+        if (faces[i].data && strcmp(faces[i].path, font_path) == 0) {
+            faces[i].last_used = ++face_clock;
+            return &faces[i];
+        }
+    }
+    
+    int fd = open(font_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("Failed to open font file: %s\n", font_path);
+        return NULL;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        printf("Failed to read font file: %s\n", font_path);
+        close(fd);
+        return NULL;
     }
-    fclose(font_file);
     
-    if (!stbtt_InitFont(&cached_font.font, cached_font.font_data, 0)) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    
+    // Check the file before evicting anything to make room for it
+    const font_atlas_header_t *atlas = NULL;
+    stbtt_fontinfo font;
+    if ((size_t)st.st_size >= sizeof(font_atlas_header_t) &&
+        memcmp(data, FONT_ATLAS_MAGIC, sizeof(((font_atlas_header_t *)0)->magic)) == 0) {
+        if (!atlas_valid(data, st.st_size)) {
+            printf("Invalid font atlas: %s\n", font_path);
+            munmap(data, st.st_size);
+            return NULL;
+        }
+        atlas = data;
+    } else if (!truetype_valid(data, st.st_size) || !stbtt_InitFont(&font, data, 0)) {
         printf("Failed to initialize font: %s\n", font_path);
-        free(cached_font.font_data);
-        cached_font.font_data = NULL;
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    
+    font_face_t *face = make_room(st.st_size);
+    if (atlas) {
+        face->atlas = atlas;
+    } else {
+        face->font = font;
+    }
+    strncpy(face->path, font_path, sizeof(face->path) - 1);
+    face->id = next_face_id++;
+    face->data = data;
+    face->data_size = st.st_size;
+    face->last_used = ++face_clock;
+    faces_bytes += face->data_size;
+    
+    printf("Loaded font: %s (%zu bytes, %zu cached)\n", font_path, face->data_size, faces_bytes);
+    return face;
+}
+
+static int load_truetype_font(const char *font_path, int font_size) {
+    font_face_t *face = load_face(font_path);
+    if (!face) {
         return -1;
     }
+    if (cached_font.face == face && cached_font.size == font_size) {
+        return 0;
+    }
+    
+    if (face->atlas) {
+        const font_atlas_size_t *size = NULL;
+        for (int s = 0; s < face->atlas->size_count; s++) {
+            if (atlas_sizes(face->atlas)[s].pixel_size == font_size) {
+                size = &atlas_sizes(face->atlas)[s];
+            }
+        }
+        if (!size) {
+            printf("Font atlas %s has no size %d\n", font_path, font_size);
+            return -1;
+        }
+        
+        cached_font.face = face;
+        cached_font.size = font_size;
+        cached_font.atlas_size = size;
+        cached_font.ascent = size->ascent;
+        return 0;
+    }
     
-    strncpy(cached_font.path, font_path, sizeof(cached_font.path) - 1);
+    cached_font.face = face;
     cached_font.size = font_size;
-    cached_font.scale = stbtt_ScaleForPixelHeight(&cached_font.font, font_size);
+    cached_font.atlas_size = NULL;
+    cached_font.scale = stbtt_ScaleForPixelHeight(&face->font, font_size);
     
-    stbtt_GetFontVMetrics(&cached_font.font, &cached_font.ascent, &cached_font.descent, &cached_font.line_gap);
+    stbtt_GetFontVMetrics(&face->font, &cached_font.ascent, &cached_font.descent, &cached_font.line_gap);
     cached_font.ascent = (int)(cached_font.ascent * cached_font.scale);
     cached_font.descent = (int)(cached_font.descent * cached_font.scale);
     cached_font.line_gap = (int)(cached_font.line_gap * cached_font.scale);
     
-    printf("Loaded font: %s, size: %d, scale: %.3f\n", font_path, font_size, cached_font.scale);
-    
     return 0;
 }
 
+static void glyph_cache_reset(void) {
+    for (int i = 0; i < GLYPH_CACHE_BUCKETS; i++) {
+        glyph_buckets[i] = -1;
+    }
+    glyph_count = 0;
+    lru_head = lru_tail = -1;
+}
+
+static unsigned glyph_bucket(unsigned face_id, int size, int glyph_index) {
+    return ((face_id * 31u + (unsigned)size) * 31u + (unsigned)glyph_index) % GLYPH_CACHE_BUCKETS;
+}
+
+static void lru_unlink(int16_t i) {
+    glyph_t *g = &glyph_cache[i];
+    if (g->lru_prev >= 0) {
+        glyph_cache[g->lru_prev].lru_next = g->lru_next;
+    } else {
+        lru_head = g->lru_next;
+    }
+    if (g->lru_next >= 0) {
+        glyph_cache[g->lru_next].lru_prev = g->lru_prev;
+    } else {
+        lru_tail = g->lru_prev;
+    }
+}
+
+static void lru_push_front(int16_t i) {
+    glyph_cache[i].lru_prev = -1;
+    glyph_cache[i].lru_next = lru_head;
+    if (lru_head >= 0) glyph_cache[lru_head].lru_prev = i;
+    lru_head = i;
+    if (lru_tail < 0) lru_tail = i;
+}
+
+// Takes a free slot, or evicts the least recently used glyph
+static int16_t glyph_alloc(void) {
+    if (glyph_count < GLYPH_CACHE_ENTRIES) {
+        return glyph_count++;
+    }
+    
+    int16_t victim = lru_tail;
+    glyph_t *g = &glyph_cache[victim];
+    int16_t *link = &glyph_buckets[glyph_bucket(g->face_id, g->size, g->glyph_index)];
+    while (*link != victim) link = &glyph_cache[*link].hash_next;
+    *link = glyph_cache[victim].hash_next;
+    lru_unlink(victim);
+    return victim;
+}
+
+// Packs an 8-bit coverage bitmap into bands of column bytes, bit 0 on top
+static void pack_glyph(const unsigned char *bitmap, int width, int height, uint8_t *bits) {
+    memset(bits, 0, ((height + 7) / 8) * width);
+    for (int py = 0; py < height; py++) {
+        uint8_t *band = bits + (py / 8) * width;
+        uint8_t bit = 1 << (py % 8);
+        for (int px = 0; px < width; px++) {
+            if (bitmap[py * width + px] > 127) band[px] |= bit;
+        }
+    }
+}
+
+// Returns the cached glyph, rasterizing it on a miss. Returns NULL if
+// the glyph is too large for a cache slot.
+static const glyph_t *get_glyph(int glyph_index) {
+    if (glyph_count < 0) glyph_cache_reset();
+    
+    unsigned face_id = cached_font.face->id;
+    unsigned bucket = glyph_bucket(face_id, cached_font.size, glyph_index);
+    for (int16_t i = glyph_buckets[bucket]; i >= 0; i = glyph_cache[i].hash_next) {
+        glyph_t *g = &glyph_cache[i];
+        if (g->face_id == face_id && g->size == cached_font.size && g->glyph_index == glyph_index) {
+            if (i != lru_head) {
+                lru_unlink(i);
+                lru_push_front(i);
+            }
+            return g;
+        }
+    }
+    
+    int x0, y0, x1, y1;
+    stbtt_GetGlyphBitmapBox(&cached_font.face->font, glyph_index, cached_font.scale, cached_font.scale, &x0, &y0, &x1, &y1);
+    if (((y1 - y0 + 7) / 8) * (x1 - x0) > GLYPH_SLOT_BYTES) {
+        return NULL;
+    }
+    
+    int width = 0, height = 0, xoff = 0, yoff = 0;
+    unsigned char *bitmap = stbtt_GetGlyphBitmap(&cached_font.face->font, cached_font.scale, cached_font.scale,
+                                                 glyph_index, &width, &height, &xoff, &yoff);
+    
+    int16_t i = glyph_alloc();
+    glyph_t *g = &glyph_cache[i];
+    g->face_id = face_id;
+    g->size = cached_font.size;
+    g->glyph_index = glyph_index;
+    g->width = bitmap ? width : 0;
+    g->height = bitmap ? height : 0;
+    g->xoff = xoff;
+    g->yoff = yoff;
+    if (bitmap) {
+        pack_glyph(bitmap, width, height, g->bits);
+        stbtt_FreeBitmap(bitmap, NULL);
+    }
+    
+    g->hash_next = glyph_buckets[bucket];
+    glyph_buckets[bucket] = i;
+    lru_push_front(i);
+    return g;
+}
+
+static void blit_glyph(const uint8_t *bits, int width, int height, int x, int y) {
+    for (int band = 0; band * 8 < height; band++) {
+        display_blit_columns(bits + band * width, width, x, y + band * 8);
+    }
+}
+
+// Draws a glyph too large for the cache straight from the rasterizer
+static void draw_glyph_uncached(int glyph_index, int x, int baseline_y) {
+    int width, height, xoff, yoff;
+    unsigned char *bitmap = stbtt_GetGlyphBitmap(&cached_font.face->font, cached_font.scale, cached_font.scale,
+                                                 glyph_index, &width, &height, &xoff, &yoff);
+    
+    if (bitmap) {
+        uint8_t *bits = malloc(((height + 7) / 8) * width);
+        if (bits) {
+            pack_glyph(bitmap, width, height, bits);
+            blit_glyph(bits, width, height, x + xoff, baseline_y + yoff);
+            free(bits);
+        }
+        stbtt_FreeBitmap(bitmap, NULL);
+    }
+}
+
+// Decodes one UTF-8 sequence and advances *s past it. A byte that does
+// not start a valid sequence is taken as Latin-1, so older clients that
+// send 8-bit text keep working.
+static uint32_t utf8_next(const char **s) {
+    static const uint32_t min_codepoint[] = {0, 0x80, 0x800, 0x10000};
+    const unsigned char *p = (const unsigned char *)*s;
+    uint32_t codepoint;
+    int extra;
+    
+    if (p[0] < 0x80) {
+        extra = 0;
+        codepoint = p[0];
+    } else if ((p[0] & 0xE0) == 0xC0) {
+        extra = 1;
+        codepoint = p[0] & 0x1F;
+    } else if ((p[0] & 0xF0) == 0xE0) {
+        extra = 2;
+        codepoint = p[0] & 0x0F;
+    } else if ((p[0] & 0xF8) == 0xF0) {
+        extra = 3;
+        codepoint = p[0] & 0x07;
+    } else {
+        *s += 1;
+        return p[0];
+    }
+    
+    for (int i = 1; i <= extra; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *s += 1;
+            return p[0];
+        }
+        codepoint = (codepoint << 6) | (p[i] & 0x3F);
+    }
+    
+    // Overlong forms, surrogates and values past U+10FFFF are malformed
+    if (codepoint < min_codepoint[extra] || codepoint > 0x10FFFF ||
+        (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+        *s += 1;
+        return p[0];
+    }
+    
+    *s += 1 + extra;
+    return codepoint;
+}
+
+static void free_run(text_run_t *run) {
+    free(run->text);
+    free(run->glyphs);
+    memset(run, 0, sizeof(*run));
+}
+
+// Returns the laid-out run for text in the current font, laying it out on
+// a miss into the least recently used slot.
+static const text_run_t *layout_text(const char *text) {
+    unsigned face_id = cached_font.face->id;
+    text_run_t *run = &runs[0];
+    
+    for (int i = 0; i < LAYOUT_CACHE_RUNS; i++) {
+        if (runs[i].text && runs[i].face_id == face_id && runs[i].size == cached_font.size &&
+            strcmp(runs[i].text, text) == 0) {
+            runs[i].last_used = ++run_clock;
+            return &runs[i];
+        }
+        if (runs[i].last_used < run->last_used) {
+            run = &runs[i];
+        }
+    }
+    
+    free_run(run);
+    
+    // Every glyph takes at least one byte of UTF-8
+    size_t len = strlen(text);
+    run->glyphs = malloc((len ? len : 1) * sizeof(*run->glyphs));
+    run->text = strdup(text);
+    if (!run->glyphs || !run->text) {
+        free_run(run);
+        return NULL;
+    }
+    run->face_id = face_id;
+    run->size = cached_font.size;
+    run->last_used = ++run_clock;
+    
+    const stbtt_fontinfo *font = &cached_font.face->font;
+    int pen_x = 0;
+    int baseline = cached_font.ascent;
+    bool has_prev = false;
+    uint32_t prev_codepoint = 0;
+    int prev_glyph = 0;
+    
+    const char *p = text;
+    while (*p) {
+        uint32_t codepoint = utf8_next(&p);
+        if (codepoint == '\n') {
+            pen_x = 0;
+            baseline += cached_font.size + 2;
+            has_prev = false;
+            continue;
+        }
+        
+        int glyph, advance;
+        if (cached_font.atlas_size) {
+            const font_atlas_glyph_t *ag = atlas_find_glyph(codepoint);
+            if (!ag) {
+                has_prev = false;
+                continue;
+            }
+            glyph = ag - atlas_glyphs(cached_font.face, cached_font.atlas_size);
+            advance = ag->advance;
+            if (has_prev) pen_x += atlas_kern(prev_codepoint, codepoint);
+        } else {
+            glyph = stbtt_FindGlyphIndex(font, codepoint);
+            if (glyph == 0) {
+                has_prev = false;
+                continue;
+            }
+            int advance_width, left_side_bearing;
+            stbtt_GetGlyphHMetrics(font, glyph, &advance_width, &left_side_bearing);
+            advance = (int)(advance_width * cached_font.scale);
+            if (has_prev) {
+                pen_x += (int)floorf(stbtt_GetGlyphKernAdvance(font, prev_glyph, glyph) * cached_font.scale + 0.5f);
+            }
+        }
+        
+        run_glyph_t *rg = &run->glyphs[run->count++];
+        rg->glyph = glyph;
+        rg->x = pen_x;
+        rg->baseline = baseline;
+        rg->end = pen_x + advance;
+        
+        pen_x += advance;
+        has_prev = true;
+        prev_codepoint = codepoint;
+        prev_glyph = glyph;
+    }
+    
+    return run;
+}
+
 void display_draw_text_truetype(const char *text, int x, int y, const char *font_path, int font_size) {
     if (!text || !font_path || strlen(font_path) == 0) {
         display_draw_text(text, x, y);
@@ -93,63 +613,43 @@ void display_draw_text_truetype(const char *text, int x, int y, const char *font
         return;
     }
     
-    int baseline_y = y + cached_font.ascent;
-    int advance_x = x;
+    const text_run_t *run = layout_text(text);
+    if (!run) {
+        printf("Out of memory laying out text\n");
+        return;
+    }
     
-    const char *ch = text;
-    while (*ch) {
-        if (*ch == '\n') {
-            advance_x = x;
-            baseline_y += font_size + 2;
-            ch++;
-            continue;
-        }
+    for (int i = 0; i < run->count; i++) {
+        const run_glyph_t *rg = &run->glyphs[i];
+        int pen_x = x + rg->x;
+        int baseline_y = y + rg->baseline;
         
         if (baseline_y >= current_config.height) break;
         
-        int glyph_index = stbtt_FindGlyphIndex(&cached_font.font, *ch);
-        if (glyph_index == 0) {
-            ch++;
-            continue;
-        }
-        
-        int width, height, xoff, yoff;
-        unsigned char *bitmap = stbtt_GetGlyphBitmap(&cached_font.font, cached_font.scale, cached_font.scale,
-                                                     glyph_index, &width, &height, &xoff, &yoff);
-        
-        if (bitmap) {
-            int glyph_x = advance_x + xoff;
-            int glyph_y = baseline_y + yoff;
-            
-            for (int py = 0; py < height; py++) {
-                for (int px = 0; px < width; px++) {
-                    int screen_x = glyph_x + px;
-                    int screen_y = glyph_y + py;
-                    
-                    if (screen_x >= 0 && screen_x < current_config.width &&
-                        screen_y >= 0 && screen_y < current_config.height) {
-                        
-                        unsigned char alpha = bitmap[py * width + px];
-                        if (alpha > 127) {
-                            display_draw_pixel(screen_x, screen_y, true);
-                        }
-                    }
-                }
+        if (cached_font.atlas_size) {
+            const font_atlas_glyph_t *ag = &atlas_glyphs(cached_font.face, cached_font.atlas_size)[rg->glyph];
+            blit_glyph(cached_font.face->data + ag->bits_offset, ag->width, ag->height,
+                       pen_x + ag->xoff, baseline_y + ag->yoff);
+        } else {
+            const glyph_t *g = get_glyph(rg->glyph);
+            if (g) {
+                blit_glyph(g->bits, g->width, g->height, pen_x + g->xoff, baseline_y + g->yoff);
+            } else {
+                draw_glyph_uncached(rg->glyph, pen_x, baseline_y);
             }
-            
-            stbtt_FreeBitmap(bitmap, NULL);
         }
         
-        int advance_width, left_side_bearing;
-        stbtt_GetGlyphHMetrics(&cached_font.font, glyph_index, &advance_width, &left_side_bearing);
-        advance_x += (int)(advance_width * cached_font.scale);
-        
-        if (advance_x >= current_config.width) break;
-        
-        ch++;
+        if (x + rg->end >= current_config.width) break;
     }
 }
 
 void display_cleanup_truetype(void) {
-    free_cached_font();
-}
\ No newline at end of file
+    for (int i = 0; i < LAYOUT_CACHE_RUNS; i++) {
+        free_run(&runs[i]);
+    }
+    for (int i = 0; i < FONT_CACHE_FACES; i++) {
+        unload_face(&faces[i]);
+    }
+    memset(&cached_font, 0, sizeof(cached_font));
+    glyph_count = -1;
+}
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "ssdsplash.h"
+
+#define WORKER_MAX_PENDING 8
+// Two threads let a small image or a preload finish while a large JPEG is
+// still decoding; the boards this runs on have few cores to spare beyond that
+#define WORKER_THREADS 2
+
+static pthread_t worker_threads[WORKER_THREADS];
+static int worker_count = 0;
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+static worker_job_t *pending_head = NULL;
+static worker_job_t *pending_tail = NULL;
+static worker_job_t *finished_head = NULL;
+static worker_job_t *finished_tail = NULL;
+static int pending_count = 0;
+static int event_fd = -1;
+static bool stopping = false;
+
+static void push_job(worker_job_t **head, worker_job_t **tail, worker_job_t *job) {
+    job->next = NULL;
+    if (*tail) {
+        (*tail)->next = job;
+    } else {
+        *head = job;
+    }
+    *tail = job;
+}
+
+static void* worker_main(void *arg) {
+    (void)arg;
+    
+    pthread_mutex_lock(&worker_lock);
+    while (!stopping) {
+        if (!pending_head) {
+            pthread_cond_wait(&worker_cond, &worker_lock);
+            continue;
+        }
+        
+        worker_job_t *job = pending_head;
+        pending_head = job->next;
+        if (!pending_head) pending_tail = NULL;
+        pending_count--;
+        pthread_mutex_unlock(&worker_lock);
+        
+        job->run(job);
+        
+        pthread_mutex_lock(&worker_lock);
+        push_job(&finished_head, &finished_tail, job);
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0) {
+            perror("eventfd write");
+        }
+    }
+    pthread_mutex_unlock(&worker_lock);
+    return NULL;
+}
+
+int worker_init(void) {
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    
+    stopping = false;
+    for (worker_count = 0; worker_count < WORKER_THREADS; worker_count++) {
+        if (pthread_create(&worker_threads[worker_count], NULL, worker_main, NULL) != 0) break;
+    }
+    if (worker_count == 0) {
+        close(event_fd);
+        event_fd = -1;
+        return -1;
+    }
+    
+    return event_fd;
+}
+
+int worker_submit(worker_job_t *job) {
+    if (event_fd < 0) return -1;
+    
+    pthread_mutex_lock(&worker_lock);
+    if (pending_count >= WORKER_MAX_PENDING) {
+        pthread_mutex_unlock(&worker_lock);
+        return -1;
+    }
+    job->cancelled = false;
+    push_job(&pending_head, &pending_tail, job);
+    pending_count++;
+    pthread_cond_signal(&worker_cond);
+    pthread_mutex_unlock(&worker_lock);
+    return 0;
+}
+
+void worker_complete(void) {
+    uint64_t count;
+    if (read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read");
+    }
+    
+    pthread_mutex_lock(&worker_lock);
+    worker_job_t *job = finished_head;
+    finished_head = finished_tail = NULL;
+    pthread_mutex_unlock(&worker_lock);
+    
+    while (job) {
+        worker_job_t *next = job->next;
+        job->done(job);
+        job = next;
+    }
+}
+
+void worker_shutdown(void) {
+    if (event_fd < 0) return;
+    
+    pthread_mutex_lock(&worker_lock);
+    stopping = true;
+    pthread_cond_broadcast(&worker_cond);
+    pthread_mutex_unlock(&worker_lock);
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(worker_threads[i], NULL);
+    }
+    worker_count = 0;
+    
+    // Jobs that never ran or were never collected still own resources;
+    // hand them back cancelled so done() only cleans up.
+    for (worker_job_t *job = pending_head; job; job = job->next) {
+        job->cancelled = true;
+    }
+    for (worker_job_t *job = finished_head; job; job = job->next) {
+        job->cancelled = true;
+    }
+    if (pending_tail) {
+        pending_tail->next = finished_head;
+        finished_head = pending_head;
+    }
+    pending_head = pending_tail = NULL;
+    pending_count = 0;
+    worker_complete();
+    
+    close(event_fd);
+    event_fd = -1;
+}
@@ -0,0 +1,61 @@
+// Scales a source wide enough that destination-column * source-width
+// products overflow 32 bits, as they would with long on 32-bit ARM.
+#include "../src/ssdsplash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SOURCE_WIDTH 20000000   // 127 * SOURCE_WIDTH > INT32_MAX
+
+int main(void) {
+    if (display_init_offscreen(DISPLAY_128x64) < 0) {
+        printf("FAIL: display_init_offscreen\n");
+        return 1;
+    }
+    
+    // Left half white, right half black
+    decoded_image_t img;
+    memset(&img, 0, sizeof(img));
+    img.width = SOURCE_WIDTH;
+    img.height = 1;
+    img.channels = 1;
+    img.frames = 1;
+    img.pixels = malloc(SOURCE_WIDTH);
+    if (!img.pixels) {
+        printf("FAIL: out of memory\n");
+        return 1;
+    }
+    memset(img.pixels, 255, SOURCE_WIDTH / 2);
+    memset(img.pixels + SOURCE_WIDTH / 2, 0, SOURCE_WIDTH - SOURCE_WIDTH / 2);
+    
+    image_render(&img, true, DITHER_BAYER);
+    
+    size_t size = display_snapshot_size();
+    uint8_t *snapshot = malloc(size);
+    if (!snapshot) {
+        printf("FAIL: out of memory\n");
+        return 1;
+    }
+    display_save_snapshot(snapshot);
+    
+    // Mono snapshots are one row of 128 column bytes per page
+    int failures = 0;
+    for (int x = 0; x < 128; x++) {
+        bool lit = false;
+        for (int page = 0; page < 8; page++) {
+            if (snapshot[page * 128 + x]) lit = true;
+        }
+        if (lit != (x < 64)) {
+            printf("FAIL: column %d is %s\n", x, lit ? "lit" : "dark");
+            failures++;
+        }
+    }
+    
+    free(snapshot);
+    free(img.pixels);
+    display_cleanup();
+    
+    if (failures) return 1;
+    printf("PASS: test_image_scale\n");
+    return 0;
+}